@@ -0,0 +1,413 @@
+#include "bamindex.h"
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+#include "bgzf.h"
+
+using namespace std;
+
+// Bins of BAI indexes, which CSI indexes generalize
+static const int BAI_MIN_SHIFT = 14;
+static const int BAI_DEPTH = 5;
+
+// Little-endian fields of an index, read one after the other
+class IndexParser
+{
+public:
+    explicit IndexParser(const string &data) : mData(data), mPosition(0), mError(false)
+    {
+    }
+
+    uint64_t Read(size_t size)
+    {
+        if (mPosition + size > mData.size())
+        {
+            mError = true;
+            mPosition = mData.size();
+            return 0;
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; i++)
+            value |= (uint64_t)(unsigned char)mData[mPosition + i] << (8 * i);
+        mPosition += size;
+        return value;
+    }
+
+    int32_t ReadInt32()
+    {
+        return (int32_t)Read(4);
+    }
+
+    uint32_t ReadUint32()
+    {
+        return (uint32_t)Read(4);
+    }
+
+    uint64_t ReadUint64()
+    {
+        return Read(8);
+    }
+
+    void Skip(size_t size)
+    {
+        if (mPosition + size > mData.size())
+            mError = true;
+        mPosition = min(mPosition + size, mData.size());
+    }
+
+    // A count is valid if its items may fit in what remains of the data
+    bool ValidCount(int32_t count, size_t itemSize)
+    {
+        if (count < 0 || (size_t)count * itemSize > mData.size() - mPosition)
+            mError = true;
+        return !mError;
+    }
+
+    bool HasError() const
+    {
+        return mError;
+    }
+
+private:
+    const string &mData;
+    size_t mPosition;
+    bool mError;
+};
+
+// First bin of a level of the binning scheme
+static uint32_t firstBin(int level)
+{
+    return ((1u << (level * 3)) - 1) / 7;
+}
+
+static bool readFile(const string &filename, string &data)
+{
+    ifstream in(filename, ios::binary);
+    if (!in)
+        return false;
+    stringstream buffer;
+    buffer << in.rdbuf();
+    data = buffer.str();
+    return !in.bad();
+}
+
+// CSI indexes are BGZF-compressed
+static bool readBgzfFile(const string &filename, string &data)
+{
+    BgzfReader reader;
+    if (!reader.Open(filename, 2))
+        return false;
+    char buffer[1 << 16];
+    data.clear();
+    size_t n;
+    while ((n = reader.Read(buffer, sizeof(buffer))) > 0)
+        data.append(buffer, n);
+    return reader.Close();
+}
+
+
+BamIndex::BamIndex() : mMinShift(BAI_MIN_SHIFT), mDepth(BAI_DEPTH)
+{
+}
+
+bool BamIndex::Open(const string &bamFilename)
+{
+    string stem = bamFilename;
+    if (stem.size() > 4 && stem.compare(stem.size() - 4, 4, ".bam") == 0)
+        stem.resize(stem.size() - 4);
+    else
+        stem.clear();
+
+    string data;
+    for (const char *extension : {".bai", ".csi"})
+    {
+        const bool csi = extension[1] == 'c';
+        for (const string &name : {bamFilename + extension, stem + extension})
+        {
+            if (name == extension)
+                continue;
+            if (csi ? readBgzfFile(name, data) : readFile(name, data))
+                return Load(data, csi);
+        }
+    }
+    return false;
+}
+
+bool BamIndex::Load(const string &data, bool csi)
+{
+    IndexParser parser(data);
+    const string magic = data.substr(0, 4);
+    parser.Skip(4);
+    if (magic != (csi ? string("CSI\1", 4) : string("BAI\1", 4)))
+        return false;
+
+    if (csi)
+    {
+        mMinShift = parser.ReadInt32();
+        mDepth = parser.ReadInt32();
+        const int32_t auxLength = parser.ReadInt32();
+        if (mMinShift <= 0 || mDepth <= 0 || mMinShift + 3 * mDepth > 62 || mDepth > 9
+            || !parser.ValidCount(auxLength, 1))
+            return false;
+        parser.Skip(auxLength);
+    }
+    else
+    {
+        mMinShift = BAI_MIN_SHIFT;
+        mDepth = BAI_DEPTH;
+    }
+    // The bin after the last level holds metadata, not records
+    const uint32_t metadataBin = firstBin(mDepth + 1) + 1;
+
+    const int32_t numReferences = parser.ReadInt32();
+    if (!parser.ValidCount(numReferences, 4))
+        return false;
+    mReferences.assign(numReferences, Reference());
+    for (Reference &ref : mReferences)
+    {
+        const int32_t numBins = parser.ReadInt32();
+        if (!parser.ValidCount(numBins, csi ? 16 : 8))
+            return false;
+        ref.Bins.reserve(numBins);
+        for (int32_t b = 0; b < numBins; b++)
+        {
+            Bin bin;
+            bin.Number = parser.ReadUint32();
+            bin.FirstOffset = csi ? parser.ReadUint64() : 0;
+            const int32_t numChunks = parser.ReadInt32();
+            if (!parser.ValidCount(numChunks, 16))
+                return false;
+            bin.Chunks.resize(numChunks);
+            for (IndexChunk &chunk : bin.Chunks)
+            {
+                chunk.Begin = parser.ReadUint64();
+                chunk.End = parser.ReadUint64();
+            }
+            if (bin.Number != metadataBin)
+                ref.Bins.push_back(move(bin));
+        }
+        sort(ref.Bins.begin(), ref.Bins.end(), [](const Bin &a, const Bin &b) {
+            return a.Number < b.Number;
+        });
+
+        if (!csi)
+        {
+            const int32_t numIntervals = parser.ReadInt32();
+            if (!parser.ValidCount(numIntervals, 8))
+                return false;
+            ref.LinearOffsets.resize(numIntervals);
+            for (uint64_t &offset : ref.LinearOffsets)
+                offset = parser.ReadUint64();
+        }
+    }
+    return !parser.HasError();
+}
+
+const BamIndex::Bin *BamIndex::FindBin(const Reference &ref, uint32_t number) const
+{
+    auto it = lower_bound(ref.Bins.begin(), ref.Bins.end(), number, [](const Bin &bin, uint32_t n) {
+        return bin.Number < n;
+    });
+    return it != ref.Bins.end() && it->Number == number ? &*it : nullptr;
+}
+
+void BamIndex::AddChunks(int32_t refID,
+                         int64_t begin,
+                         int64_t end,
+                         vector<IndexChunk> &chunks) const
+{
+    if (refID < 0 || refID >= (int32_t)mReferences.size())
+        return;
+    const Reference &ref = mReferences[refID];
+    const int64_t maxEnd = (int64_t)1 << (mMinShift + 3 * mDepth);
+    begin = max(begin, (int64_t)0);
+    end = min(end, maxEnd);
+    if (begin >= end)
+        return;
+
+    // Records that end before begin are stored before this offset
+    uint64_t minOffset = 0;
+    if (!ref.LinearOffsets.empty())
+    {
+        const size_t window = min((size_t)(begin >> BAI_MIN_SHIFT), ref.LinearOffsets.size() - 1);
+        minOffset = ref.LinearOffsets[window];
+    }
+    else
+    {
+        // Smallest bin holding begin that has records, up to the root
+        for (uint32_t bin = firstBin(mDepth) + (begin >> mMinShift);; bin = (bin - 1) >> 3)
+        {
+            const Bin *found = FindBin(ref, bin);
+            if (found != nullptr)
+            {
+                minOffset = found->FirstOffset;
+                break;
+            }
+            if (bin == 0)
+                break;
+        }
+    }
+
+    // Bins of each level that overlap the interval
+    end--;
+    for (int level = 0; level <= mDepth; level++)
+    {
+        const int shift = mMinShift + 3 * (mDepth - level);
+        for (int64_t n = begin >> shift; n <= end >> shift; n++)
+        {
+            const Bin *bin = FindBin(ref, firstBin(level) + n);
+            if (bin == nullptr)
+                continue;
+            for (const IndexChunk &chunk : bin->Chunks)
+                if (chunk.End > minOffset)
+                    chunks.push_back(chunk);
+        }
+    }
+}
+
+
+void mergeChunks(vector<IndexChunk> &chunks)
+{
+    sort(chunks.begin(), chunks.end(), [](const IndexChunk &a, const IndexChunk &b) {
+        return a.Begin < b.Begin;
+    });
+    size_t merged = 0;
+    for (size_t k = 0; k < chunks.size(); k++)
+    {
+        if (merged > 0 && chunks[k].Begin <= chunks[merged - 1].End)
+            chunks[merged - 1].End = max(chunks[merged - 1].End, chunks[k].End);
+        else
+            chunks[merged++] = chunks[k];
+    }
+    chunks.resize(merged);
+}
+
+
+// Smallest bin of the BAI scheme holding [begin, end)
+static uint32_t reg2bin(int64_t begin, int64_t end)
+{
+    end--;
+    for (int level = BAI_DEPTH; level > 0; level--)
+    {
+        const int shift = BAI_MIN_SHIFT + 3 * (BAI_DEPTH - level);
+        if (begin >> shift == end >> shift)
+            return firstBin(level) + (begin >> shift);
+    }
+    return 0;
+}
+
+static void appendValue(string &buffer, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        buffer += (char)((value >> (8 * i)) & 0xff);
+}
+
+// Virtual offset of a byte of the uncompressed stream, all BGZF blocks but the last being full
+static uint64_t virtualOffset(uint64_t offset, const vector<uint64_t> &blockOffsets)
+{
+    const size_t block = min((size_t)(offset / BGZF_BLOCK_DATA_SIZE), blockOffsets.size() - 1);
+    return blockOffsets[block] << 16 | (offset - block * BGZF_BLOCK_DATA_SIZE);
+}
+
+BaiWriter::BaiWriter(size_t numReferences) : mReferences(numReferences), mUnplaced(0)
+{
+    for (Reference &ref : mReferences)
+    {
+        ref.Range.Begin = numeric_limits<uint64_t>::max();
+        ref.Range.End = 0;
+        ref.Mapped = 0;
+        ref.Unmapped = 0;
+    }
+}
+
+void BaiWriter::Add(int32_t refID,
+                    int64_t pos,
+                    int64_t end,
+                    bool mapped,
+                    uint64_t begin,
+                    uint64_t endOffset)
+{
+    if (refID < 0 || refID >= (int32_t)mReferences.size())
+    {
+        mUnplaced++;
+        return;
+    }
+    Reference &ref = mReferences[refID];
+    pos = max(pos, (int64_t)0);
+    end = max(end, pos + 1);
+
+    // Records that follow each other in a bin share a chunk
+    vector<IndexChunk> &chunks = ref.Bins[reg2bin(pos, end)];
+    if (!chunks.empty() && chunks.back().End == begin)
+        chunks.back().End = endOffset;
+    else
+        chunks.push_back({begin, endOffset});
+
+    const size_t lastWindow = (end - 1) >> BAI_MIN_SHIFT;
+    if (ref.LinearOffsets.size() <= lastWindow)
+        ref.LinearOffsets.resize(lastWindow + 1, numeric_limits<uint64_t>::max());
+    for (size_t w = pos >> BAI_MIN_SHIFT; w <= lastWindow; w++)
+        ref.LinearOffsets[w] = min(ref.LinearOffsets[w], begin);
+
+    ref.Range.Begin = min(ref.Range.Begin, begin);
+    ref.Range.End = max(ref.Range.End, endOffset);
+    if (mapped)
+        ref.Mapped++;
+    else
+        ref.Unmapped++;
+}
+
+bool BaiWriter::Write(const string &filename, const vector<uint64_t> &blockOffsets) const
+{
+    if (blockOffsets.empty())
+        return false;
+    string data("BAI\1", 4);
+    appendValue(data, mReferences.size(), 4);
+    for (const Reference &ref : mReferences)
+    {
+        if (ref.Mapped + ref.Unmapped == 0)
+        {
+            appendValue(data, 0, 4); // bins
+            appendValue(data, 0, 4); // linear index
+            continue;
+        }
+
+        // The bins, then the metadata bin: range of offsets and counts of records
+        appendValue(data, ref.Bins.size() + 1, 4);
+        for (const auto &bin : ref.Bins)
+        {
+            appendValue(data, bin.first, 4);
+            appendValue(data, bin.second.size(), 4);
+            for (const IndexChunk &chunk : bin.second)
+            {
+                appendValue(data, virtualOffset(chunk.Begin, blockOffsets), 8);
+                appendValue(data, virtualOffset(chunk.End, blockOffsets), 8);
+            }
+        }
+        appendValue(data, firstBin(BAI_DEPTH + 1) + 1, 4);
+        appendValue(data, 2, 4);
+        appendValue(data, virtualOffset(ref.Range.Begin, blockOffsets), 8);
+        appendValue(data, virtualOffset(ref.Range.End, blockOffsets), 8);
+        appendValue(data, ref.Mapped, 8);
+        appendValue(data, ref.Unmapped, 8);
+
+        // Windows without records get the offset of the previous one, or of the first record
+        appendValue(data, ref.LinearOffsets.size(), 4);
+        uint64_t previous = ref.Range.Begin;
+        for (uint64_t offset : ref.LinearOffsets)
+        {
+            if (offset != numeric_limits<uint64_t>::max())
+                previous = offset;
+            appendValue(data, virtualOffset(previous, blockOffsets), 8);
+        }
+    }
+    appendValue(data, mUnplaced, 8);
+
+    ofstream out(filename, ios::binary);
+    out.write(data.data(), data.size());
+    out.close();
+    return !out.fail();
+}
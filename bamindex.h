@@ -0,0 +1,90 @@
+#ifndef BAMINDEX_H
+#define BAMINDEX_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Range [Begin, End) of virtual offsets of a BGZF file
+struct IndexChunk
+{
+    uint64_t Begin;
+    uint64_t End;
+};
+
+// BAI or CSI index of a BAM file sorted by coordinates. Only the bins (and the linear index of
+// BAI) are loaded, to find the parts of the file holding the records that may overlap a region.
+class BamIndex
+{
+public:
+    BamIndex();
+
+    // Load the index of bamFilename, looked for in bamFilename.bai, in bamFilename with .bai
+    // instead of .bam, then in the same names with .csi. Returns false if none can be read.
+    bool Open(const std::string &bamFilename);
+    // Append to chunks the parts of the file holding the records of reference refID (a RefID of
+    // the file) that may overlap the 0-based interval [begin, end)
+    void AddChunks(int32_t refID,
+                   int64_t begin,
+                   int64_t end,
+                   std::vector<IndexChunk> &chunks) const;
+
+private:
+    struct Bin
+    {
+        uint32_t Number;
+        uint64_t FirstOffset; // CSI: offset of the first record overlapping the bin
+        std::vector<IndexChunk> Chunks;
+    };
+    struct Reference
+    {
+        std::vector<Bin> Bins;              // sorted by number
+        std::vector<uint64_t> LinearOffsets; // BAI: first offset of each 16 kb window
+    };
+
+    bool Load(const std::string &data, bool csi);
+    const Bin *FindBin(const Reference &ref, uint32_t number) const;
+
+    int mMinShift; // size of the smallest bins: 1 << mMinShift
+    int mDepth;    // levels of bins below the root
+    std::vector<Reference> mReferences;
+};
+
+// BAI index built while a BAM file sorted by coordinates is written. Records are added with their
+// offsets in the uncompressed stream, which Write() translates into virtual offsets.
+class BaiWriter
+{
+public:
+    explicit BaiWriter(size_t numReferences);
+
+    // Add a record covering [pos, end) of reference refID (-1 for unplaced records), stored at
+    // [begin, endOffset) of the uncompressed stream
+    void Add(int32_t refID,
+             int64_t pos,
+             int64_t end,
+             bool mapped,
+             uint64_t begin,
+             uint64_t endOffset);
+    // Write the index of a stream whose BGZF blocks start at blockOffsets (see
+    // BgzfWriter::BlockOffsets()). Returns false if the file cannot be written.
+    bool Write(const std::string &filename, const std::vector<uint64_t> &blockOffsets) const;
+
+private:
+    struct Reference
+    {
+        std::map<uint32_t, std::vector<IndexChunk>> Bins;
+        std::vector<uint64_t> LinearOffsets; // UINT64_MAX: no record starts in the window
+        IndexChunk Range;                    // offsets of the first and past the last record
+        uint64_t Mapped;
+        uint64_t Unmapped;
+    };
+
+    std::vector<Reference> mReferences;
+    uint64_t mUnplaced;
+};
+
+// Sort chunks by offset and merge those that overlap or touch, so that each record is read once
+void mergeChunks(std::vector<IndexChunk> &chunks);
+
+#endif
@@ -0,0 +1,599 @@
+#include "bamio.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "cram.h"
+#include "md.h"
+
+using namespace std;
+using namespace BamTools;
+
+static int32_t unpackInt32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return (int32_t)(u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24);
+}
+
+static uint16_t unpackUint16(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return u[0] | u[1] << 8;
+}
+
+static void packInt32(char *p, int32_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+static void appendInt32(string &buffer, int32_t value)
+{
+    char bytes[4];
+    packInt32(bytes, value);
+    buffer.append(bytes, 4);
+}
+
+uint64_t hashReadName(const char *name, uint64_t salt)
+{
+    uint64_t h = 14695981039346656037ULL ^ (salt * 0x9e3779b97f4a7c15ULL);
+    for (; *name != '\0'; name++)
+    {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+BamInput::BamInput() : mError(false)
+{
+}
+
+void BamInput::SetCramReference(const string &fasta)
+{
+    mCramReference = fasta;
+}
+
+bool BamInput::Open(const string &filename)
+{
+    mError = false;
+    if (isCramFile(filename) ? !mStream.OpenCommand(cramReadCommand(filename, mCramReference))
+                             : !mStream.Open(filename))
+        return false;
+
+    char magic[4];
+    int32_t textLength;
+    int32_t numReferences;
+    if (mStream.Read(magic, 4) != 4 || memcmp(magic, "BAM\1", 4) != 0 || !ReadInt32(textLength)
+        || textLength < 0)
+    {
+        mStream.Close();
+        return false;
+    }
+
+    mHeaderText.resize(textLength);
+    if (mStream.Read(&mHeaderText[0], textLength) != (size_t)textLength
+        || !ReadInt32(numReferences) || numReferences < 0)
+    {
+        mStream.Close();
+        return false;
+    }
+    // Some writers pad the header text with NUL characters
+    mHeaderText.resize(strlen(mHeaderText.c_str()));
+
+    mReferences.clear();
+    for (int32_t i = 0; i < numReferences; i++)
+    {
+        int32_t nameLength;
+        RefData ref;
+        if (!ReadInt32(nameLength) || nameLength <= 0)
+        {
+            mStream.Close();
+            return false;
+        }
+        ref.RefName.resize(nameLength);
+        if (mStream.Read(&ref.RefName[0], nameLength) != (size_t)nameLength
+            || !ReadInt32(ref.RefLength))
+        {
+            mStream.Close();
+            return false;
+        }
+        ref.RefName.resize(nameLength - 1); // drop NUL
+        mReferences.push_back(ref);
+    }
+    return true;
+}
+
+bool BamInput::Close()
+{
+    return mStream.Close();
+}
+
+const string &BamInput::GetHeaderText() const
+{
+    return mHeaderText;
+}
+
+const RefVector &BamInput::GetReferenceData() const
+{
+    return mReferences;
+}
+
+void BamInput::SetRefIDMap(const vector<int32_t> &refIDMap)
+{
+    mRefIDMap.clear();
+    for (size_t r = 0; r < refIDMap.size(); r++)
+    {
+        if (refIDMap[r] != (int32_t)r)
+        {
+            mRefIDMap = refIDMap;
+            break;
+        }
+    }
+}
+
+bool BamInput::HasError() const
+{
+    return mError || mStream.HasError();
+}
+
+bool BamInput::ReadInt32(int32_t &value)
+{
+    char bytes[4];
+    if (mStream.Read(bytes, 4) != 4)
+        return false;
+    value = unpackInt32(bytes);
+    return true;
+}
+
+bool BamInput::GetNextAlignmentCore(BamRecord &rec)
+{
+    char bytes[4];
+    // A clean end of file happens between two records
+    if (mStream.Read(bytes, 1) != 1)
+        return false;
+    if (mStream.Read(bytes + 1, 3) != 3)
+    {
+        mError = true;
+        return false;
+    }
+
+    int32_t blockSize = unpackInt32(bytes);
+    if (blockSize < 32)
+    {
+        mError = true;
+        return false;
+    }
+    rec.mData.resize(blockSize);
+    if (mStream.Read(&rec.mData[0], blockSize) != (size_t)blockSize)
+    {
+        mError = true;
+        return false;
+    }
+
+    if (!rec.ParseCore() || (!mRefIDMap.empty() && !rec.MapRefIDs(mRefIDMap)))
+    {
+        mError = true;
+        return false;
+    }
+    return true;
+}
+
+uint64_t BamInput::Tell()
+{
+    return mStream.Tell();
+}
+
+bool BamInput::Seek(uint64_t virtualOffset)
+{
+    if (!mStream.Seek(virtualOffset))
+    {
+        mError = true;
+        return false;
+    }
+    return true;
+}
+
+
+BamRecord::BamRecord() : RefID(-1), Position(-1), AlignmentFlag(0)
+{
+}
+
+// Check the consistency of the raw data and decode its core fields
+bool BamRecord::ParseCore()
+{
+    if (mData.size() < 32)
+        return false;
+
+    const char *p = mData.data();
+    const uint8_t nameLength = p[8];
+    const uint16_t numCigarOperations = unpackUint16(p + 12);
+    const int32_t queryLength = unpackInt32(p + 16);
+    if (nameLength == 0 || queryLength < 0
+        || 32 + nameLength + 4 * numCigarOperations + (queryLength + 1) / 2 + (size_t)queryLength
+               > mData.size()
+        || p[32 + nameLength - 1] != '\0')
+        return false;
+
+    RefID = unpackInt32(p);
+    Position = unpackInt32(p + 4);
+    AlignmentFlag = unpackUint16(p + 14);
+    return true;
+}
+
+// Translate refID and next_refID in place, -1 (no reference) is kept
+bool BamRecord::MapRefIDs(const vector<int32_t> &refIDMap)
+{
+    for (size_t offset : {0, 20})
+    {
+        int32_t refID = unpackInt32(&mData[offset]);
+        if (refID < 0)
+            continue;
+        if ((size_t)refID >= refIDMap.size())
+            return false;
+        packInt32(&mData[offset], refIDMap[refID]);
+    }
+    RefID = unpackInt32(mData.data());
+    return true;
+}
+
+const string &BamRecord::RawData() const
+{
+    return mData;
+}
+
+bool BamRecord::SetRawData(const char *data, size_t length)
+{
+    mData.assign(data, length);
+    return ParseCore();
+}
+
+const char *BamRecord::Name() const
+{
+    return mData.size() > 32 ? mData.data() + 32 : "";
+}
+
+bool BamRecord::IsPaired() const
+{
+    return (AlignmentFlag & 0x0001) != 0;
+}
+
+bool BamRecord::IsMapped() const
+{
+    return (AlignmentFlag & 0x0004) == 0;
+}
+
+bool BamRecord::IsFirstMate() const
+{
+    return (AlignmentFlag & 0x0040) != 0;
+}
+
+const char *BamRecord::Cigar() const
+{
+    return mData.data() + 32 + (uint8_t)mData[8];
+}
+
+uint16_t BamRecord::NumCigarOperations() const
+{
+    return unpackUint16(mData.data() + 12);
+}
+
+uint32_t BamRecord::CigarOperation(int i) const
+{
+    return unpackInt32(Cigar() + 4 * i);
+}
+
+int64_t BamRecord::ReferenceLength() const
+{
+    return cigarReferenceLength(Cigar(), NumCigarOperations());
+}
+
+int64_t cigarReferenceLength(const char *cigar, uint16_t numOperations)
+{
+    int64_t length = 0;
+    for (uint16_t k = 0; k < numOperations; k++)
+    {
+        const uint32_t op = unpackInt32(cigar + 4 * k);
+        // M, D, N, = and X consume the reference
+        if ((0x18d >> (op & 0xf)) & 1)
+            length += op >> 4;
+    }
+    return length;
+}
+
+size_t tagSize(const char *p, const char *end)
+{
+    if (p + 3 > end)
+        return 0;
+    size_t size = 3;
+    switch (p[2])
+    {
+    case 'A':
+    case 'c':
+    case 'C':
+        size += 1;
+        break;
+    case 's':
+    case 'S':
+        size += 2;
+        break;
+    case 'i':
+    case 'I':
+    case 'f':
+        size += 4;
+        break;
+    case 'Z':
+    case 'H':
+    {
+        const char *nul = (const char *)memchr(p + 3, '\0', end - p - 3);
+        if (nul == nullptr)
+            return 0;
+        size = nul + 1 - p;
+        break;
+    }
+    case 'B':
+    {
+        if (p + 8 > end)
+            return 0;
+        char subtype = p[3];
+        int32_t count = unpackInt32(p + 4);
+        int itemSize = (subtype == 'c' || subtype == 'C') ? 1
+                       : (subtype == 's' || subtype == 'S') ? 2
+                                                            : 4;
+        if (count < 0)
+            return 0;
+        size += 5 + (size_t)count * itemSize;
+        break;
+    }
+    default: // corrupted data
+        return 0;
+    }
+    return p + size <= end ? size : 0;
+}
+
+size_t BamRecord::TagsOffset() const
+{
+    const char *p = mData.data();
+    const int32_t queryLength = unpackInt32(p + 16);
+    return 32 + (uint8_t)p[8] + 4 * unpackUint16(p + 12) + (queryLength + 1) / 2 + queryLength;
+}
+
+// Look for an optional field in the raw auxiliary data
+bool BamRecord::HasTag(const char *tag) const
+{
+    const char *end = mData.data() + mData.size();
+    size_t size;
+    for (const char *p = mData.data() + TagsOffset(); (size = tagSize(p, end)) > 0; p += size)
+    {
+        if (p[0] == tag[0] && p[1] == tag[1])
+            return true;
+    }
+    return false;
+}
+
+void BamRecord::SetIsPrimaryAlignment(bool ok)
+{
+    if (ok)
+        AlignmentFlag &= ~0x0100;
+    else
+        AlignmentFlag |= 0x0100;
+    mData[14] = AlignmentFlag & 0xff;
+    mData[15] = AlignmentFlag >> 8;
+}
+
+BamOutput::BamOutput() :
+    mHeaderSize(0),
+    mNumReferences(0),
+    mSortMemoryLimit(0),
+    mSorter(nullptr),
+    mMdTagger(nullptr),
+    mSeconds(0),
+    mQueue(nullptr),
+    mQueueDepth(0),
+    mError(false)
+{
+}
+
+BamOutput::~BamOutput()
+{
+    StopThread();
+    delete mSorter;
+}
+
+void BamOutput::SetSortByCoordinates(size_t memoryLimit, const string &tempPrefix)
+{
+    mSortMemoryLimit = memoryLimit;
+    mSortTempPrefix = tempPrefix;
+}
+
+void BamOutput::SetCramReference(const string &fasta)
+{
+    mCramReference = fasta;
+}
+
+void BamOutput::SetMdTagger(MdTagger *tagger)
+{
+    mMdTagger = tagger;
+}
+
+bool BamOutput::Open(const string &filename,
+                     const string &headerText,
+                     const RefVector &references,
+                     int compressionLevel,
+                     BgzfPool *pool,
+                     size_t queueDepth)
+{
+    // samtools encodes the records again, the stream handed to it is not compressed
+    if (hasCramExtension(filename))
+    {
+        const string command = cramWriteCommand(filename, mCramReference, mSortMemoryLimit > 0);
+        if (!mStream.OpenCommand(command, 0, pool))
+            return false;
+    }
+    else if (!mStream.Open(filename, compressionLevel, pool))
+        return false;
+
+    string header = "BAM\1";
+    appendInt32(header, headerText.size());
+    header += headerText;
+    appendInt32(header, references.size());
+    for (auto &ref : references)
+    {
+        appendInt32(header, ref.RefName.size() + 1);
+        header.append(ref.RefName.c_str(), ref.RefName.size() + 1);
+        appendInt32(header, ref.RefLength);
+    }
+    if (!mStream.Write(header.data(), header.size()))
+        return false;
+
+    mFilename = filename;
+    mHeaderSize = header.size();
+    mNumReferences = references.size();
+    if (mSortMemoryLimit > 0)
+        mSorter = new BamSorter(mSortMemoryLimit, mSortTempPrefix, pool);
+
+    mError = false;
+    StartThread(queueDepth);
+    return true;
+}
+
+bool BamOutput::Resume(const string &filename,
+                       uint64_t size,
+                       int compressionLevel,
+                       BgzfPool *pool,
+                       size_t queueDepth)
+{
+    if (mSortMemoryLimit > 0 || hasCramExtension(filename)
+        || !mStream.Resume(filename, size, compressionLevel, pool))
+        return false;
+    mFilename = filename;
+    mError = false;
+    StartThread(queueDepth);
+    return true;
+}
+
+bool BamOutput::SaveAlignment(const BamRecord &rec, int refNumber)
+{
+    const bool addTag = refNumber != 0 && !rec.HasTag("RN");
+    const string *data = &rec.mData;
+    if (mMdTagger != nullptr && mMdTagger->Tag(rec, refNumber, mTagged))
+        data = &mTagged;
+
+    char tag[7] = {'R', 'N', 'i'};
+    packInt32(tag + 3, refNumber);
+    appendInt32(mBatch, data->size() + (addTag ? sizeof(tag) : 0));
+    mBatch += *data;
+    if (addTag)
+        mBatch.append(tag, sizeof(tag));
+
+    return mBatch.size() < BAM_BATCH_SIZE || Flush();
+}
+
+bool BamOutput::Flush()
+{
+    if (mQueue != nullptr)
+    {
+        // mBatch receives an empty buffer back from the thread
+        if (!mBatch.empty() && !mQueue->Push(mBatch))
+            return false;
+        mBatch.clear();
+        return !mError;
+    }
+
+    bool ok = WriteStream(mBatch);
+    mBatch.clear();
+    return ok;
+}
+
+bool BamOutput::WriteStream(const string &batch)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool ok = mSorter != nullptr ? mSorter->Add(batch) : mStream.Write(batch.data(), batch.size());
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    mSeconds += elapsed.count();
+    return ok;
+}
+
+void BamOutput::StartThread(size_t queueDepth)
+{
+    mQueueDepth = queueDepth;
+    if (queueDepth > 0)
+    {
+        mQueue = new SpscQueue<string>(queueDepth);
+        mThread = thread(&BamOutput::WriteBatches, this);
+    }
+}
+
+void BamOutput::WriteBatches()
+{
+    string batch;
+    while (mQueue->Pop(batch))
+    {
+        if (!WriteStream(batch))
+        {
+            // Stop the producer, the error is reported by Flush() and Close()
+            mError = true;
+            mQueue->Close();
+            return;
+        }
+        batch.clear();
+    }
+}
+
+void BamOutput::StopThread()
+{
+    if (mQueue == nullptr)
+        return;
+    mQueue->Close();
+    mThread.join();
+    delete mQueue;
+    mQueue = nullptr;
+}
+
+// The thread of the writer is stopped once it has written the batches of its queue, then started
+// again
+bool BamOutput::Sync(uint64_t &fileSize)
+{
+    if (mSorter != nullptr)
+        return false;
+    bool ok = Flush();
+    StopThread();
+    ok = ok && !mError && mStream.Sync(fileSize);
+    StartThread(mQueueDepth);
+    return ok;
+}
+
+bool BamOutput::Close()
+{
+    bool ok = Flush();
+    StopThread();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (mSorter != nullptr)
+    {
+        BaiWriter index(mNumReferences);
+        ok = mSorter->Write(mStream, mHeaderSize, index) && ok && !mError;
+        ok = mStream.Close() && ok;
+        if (ok && mFilename != "-" && !hasCramExtension(mFilename)
+            && !index.Write(mFilename + ".bai", mStream.BlockOffsets()))
+        {
+            cerr << "Error: Could not write index " << mFilename << ".bai." << endl;
+            ok = false;
+        }
+        delete mSorter;
+        mSorter = nullptr;
+    }
+    else
+        ok = mStream.Close() && ok && !mError;
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    mSeconds += elapsed.count();
+    return ok;
+}
+
+double BamOutput::WriteSeconds() const
+{
+    return mSeconds;
+}
@@ -0,0 +1,181 @@
+#ifndef BAMIO_H
+#define BAMIO_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "api/BamAux.h"
+#include "bgzf.h"
+#include "queue.h"
+#include "sorter.h"
+
+// Size of the batches of encoded records handed to the BGZF stream of a BamOutput
+const size_t BAM_BATCH_SIZE = 4 << 20;
+
+// BAM record kept in its binary form. Only the fixed-length core fields are decoded when the
+// record is read; the name and the CIGAR are read directly from the raw data, and the raw data is
+// written back unchanged by BamOutput.
+class BamRecord
+{
+public:
+    BamRecord();
+
+    const char *Name() const; // NUL-terminated
+    bool IsPaired() const;
+    bool IsMapped() const;
+    bool IsFirstMate() const;
+    bool HasTag(const char *tag) const;
+    // Offset of the optional fields in the raw data
+    size_t TagsOffset() const;
+    // CIGAR as stored in the raw data: NumCigarOperations() little-endian 32-bit words, holding
+    // the length of an operation shifted by 4 bits and its index in "MIDNSHP=X"
+    const char *Cigar() const;
+    uint16_t NumCigarOperations() const;
+    uint32_t CigarOperation(int i) const;
+    // Reference bases covered by the CIGAR
+    int64_t ReferenceLength() const;
+    void SetIsPrimaryAlignment(bool ok);
+
+    // Raw record, without its block_size
+    const std::string &RawData() const;
+    bool SetRawData(const char *data, size_t length);
+
+    int32_t RefID;
+    int32_t Position;
+    uint16_t AlignmentFlag;
+
+private:
+    friend class BamInput;
+    friend class BamOutput;
+
+    bool ParseCore();
+    bool MapRefIDs(const std::vector<int32_t> &refIDMap);
+
+    std::string mData; // raw record, without its block_size
+};
+
+// Reference bases covered by numOperations packed CIGAR operations (M, D, N, = and X)
+int64_t cigarReferenceLength(const char *cigar, uint16_t numOperations);
+
+// Size of the optional field at p (tag, type and value), 0 if it is corrupted or runs past end
+size_t tagSize(const char *p, const char *end);
+
+// FNV-1a hash of a read name, used to partition the reads. Different salts give independent
+// partitionings.
+uint64_t hashReadName(const char *name, uint64_t salt = 0);
+
+// BAM file reader on top of BgzfReader. Mirrors the part of BamTools::BamReader used by
+// bam-mergeRef; the BGZF blocks are inflated ahead of the reader by a background thread.
+class BamInput
+{
+public:
+    BamInput();
+
+    // FASTA file the CRAM input files are decoded with, empty to let samtools find the reference.
+    // Must be called before Open().
+    void SetCramReference(const std::string &fasta);
+    // BAM file, or CRAM file decoded by samtools ("-" reads a BAM stream from the standard input)
+    bool Open(const std::string &filename);
+    bool Close();
+    const std::string &GetHeaderText() const;
+    const BamTools::RefVector &GetReferenceData() const;
+    // Translate the RefIDs of the records read (and those of their mates) into another dictionary:
+    // refIDMap[r] is the new RefID of reference r of the file
+    void SetRefIDMap(const std::vector<int32_t> &refIDMap);
+    // Read the next record, only decoding its core fields. Returns false at the end of the file
+    // or on error, HasError() tells them apart.
+    bool GetNextAlignmentCore(BamRecord &rec);
+    // Virtual offset of the next record, as stored in BAI and CSI indexes
+    uint64_t Tell();
+    // Go to the record at a virtual offset
+    bool Seek(uint64_t virtualOffset);
+    bool HasError() const;
+
+private:
+    bool ReadInt32(int32_t &value);
+
+    BgzfReader mStream;
+    std::string mCramReference;
+    std::string mHeaderText;
+    BamTools::RefVector mReferences;
+    std::vector<int32_t> mRefIDMap; // empty: the RefIDs are kept
+    bool mError;
+};
+
+class MdTagger;
+
+// BAM file writer on top of BgzfWriter. Mirrors the part of BamTools::BamWriter used by
+// bam-mergeRef, but lets the BGZF blocks be compressed by a pool of threads and writes the
+// records without re-encoding them.
+class BamOutput
+{
+public:
+    BamOutput();
+    ~BamOutput();
+
+    // Write the records sorted by coordinates, with a BAI index in filename.bai (a CRAI index
+    // written by samtools for CRAM, none on the standard output), instead of in the order they are
+    // saved. They are sorted by a BamSorter holding up to memoryLimit bytes, with its runs next to
+    // tempPrefix, when the file is closed. Must be called before Open().
+    void SetSortByCoordinates(size_t memoryLimit, const std::string &tempPrefix);
+    // FASTA file the output is encoded against when its name ends with .cram. Must be called before
+    // Open().
+    void SetCramReference(const std::string &fasta);
+    // Recompute the MD and NM tags of the records saved with tagger (not owned), nullptr to keep
+    // them as they were read
+    void SetMdTagger(MdTagger *tagger);
+    // With a queue depth, the batches are fed to the BGZF stream by a thread of the writer, with
+    // up to queueDepth batches waiting
+    bool Open(const std::string &filename,
+              const std::string &headerText,
+              const BamTools::RefVector &references,
+              int compressionLevel,
+              BgzfPool *pool = nullptr,
+              size_t queueDepth = 0);
+    // Continue a file written up to a size returned by Sync(), instead of Open(): the file is
+    // truncated to that size and the records are appended, after the header written before.
+    bool Resume(const std::string &filename,
+                uint64_t size,
+                int compressionLevel,
+                BgzfPool *pool = nullptr,
+                size_t queueDepth = 0);
+    // Write a record as it was read, followed by an RN:i tag holding refNumber (unless
+    // refNumber is 0 or the record already has an RN tag). Records are encoded into a batch that is
+    // handed to the BGZF stream by Flush(), or once it holds BAM_BATCH_SIZE bytes.
+    bool SaveAlignment(const BamRecord &rec, int refNumber = 0);
+    bool Flush();
+    // Write all the records saved so far to the disk, ending the current BGZF block. fileSize
+    // receives the size of the file, for Resume(). Not for files sorted by coordinates.
+    bool Sync(uint64_t &fileSize);
+    bool Close();
+    // Time spent compressing and writing the records, complete once the file is closed
+    double WriteSeconds() const;
+
+private:
+    bool WriteStream(const std::string &batch);
+    void StartThread(size_t queueDepth);
+    void WriteBatches();
+    void StopThread();
+
+    BgzfWriter mStream;
+    std::string mBatch;
+    std::string mFilename;
+    uint64_t mHeaderSize; // bytes of the uncompressed stream before the records
+    size_t mNumReferences;
+    size_t mSortMemoryLimit; // 0: the records are written in the order they are saved
+    std::string mSortTempPrefix;
+    std::string mCramReference;
+    BamSorter *mSorter;
+    MdTagger *mMdTagger;
+    std::string mTagged; // raw data of the record being saved, with new MD and NM tags
+    double mSeconds; // updated by mThread while it runs
+
+    SpscQueue<std::string> *mQueue; // nullptr: batches are written by Flush()
+    size_t mQueueDepth;
+    std::thread mThread;
+    std::atomic<bool> mError; // set by mThread
+};
+
+#endif
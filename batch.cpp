@@ -0,0 +1,168 @@
+#include "batch.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+using namespace std;
+
+
+GroupBatch::GroupBatch() : EndOffset(UINT64_MAX), mNumRecords(0)
+{
+}
+
+void GroupBatch::Clear()
+{
+    Groups.clear();
+    Keys.clear();
+    mNumRecords = 0;
+}
+
+bool GroupBatch::Empty() const
+{
+    return Groups.empty();
+}
+
+BamRecord &GroupBatch::AddRecord()
+{
+    if (mNumRecords == Records.size())
+        Records.emplace_back();
+    return Records[mNumRecords++];
+}
+
+const char *GroupBatch::Key(const NameGroup &group) const
+{
+    return Keys.data() + group.KeyOffset;
+}
+
+
+GroupReader::GroupReader(BamInput &file,
+                         int fileNumber,
+                         size_t batchGroups,
+                         NameOrder order,
+                         size_t queueDepth,
+                         const string &lastName) :
+    mFile(file),
+    mFileNumber(fileNumber),
+    mBatchGroups(batchGroups),
+    mOrder(order),
+    mNextOffset(0),
+    mHasNext(false),
+    mEof(false),
+    mSeconds(0),
+    mQueue(nullptr)
+{
+    if (!lastName.empty())
+        makeNameKey(lastName.c_str(), mOrder, mPreviousKey);
+    if (queueDepth > 0)
+    {
+        mQueue = new SpscQueue<GroupBatch>(queueDepth);
+        mThread = thread(&GroupReader::ReadAhead, this);
+    }
+}
+
+GroupReader::~GroupReader()
+{
+    if (mQueue != nullptr)
+    {
+        // Stops the thread if the consumer gave up before the end of the file
+        mQueue->Close();
+        mThread.join();
+        delete mQueue;
+    }
+}
+
+bool GroupReader::ReadBatch(GroupBatch &batch)
+{
+    if (mQueue == nullptr)
+        return FillBatch(batch);
+    // The queue is closed without a last batch on error
+    return mQueue->Pop(batch);
+}
+
+double GroupReader::Seconds() const
+{
+    return mSeconds;
+}
+
+void GroupReader::ReadAhead()
+{
+    GroupBatch batch;
+    while (1)
+    {
+        if (!FillBatch(batch))
+        {
+            mQueue->Close();
+            return;
+        }
+        bool end = batch.Empty();
+        if (!mQueue->Push(batch) || end)
+            return;
+    }
+}
+
+bool GroupReader::FillBatch(GroupBatch &batch)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    batch.Clear();
+    while (batch.Groups.size() < mBatchGroups)
+    {
+        if (!mHasNext)
+        {
+            mNextOffset = mFile.Tell();
+            if (mEof || !mFile.GetNextAlignmentCore(mNext))
+            {
+                mEof = true;
+                break;
+            }
+        }
+        mHasNext = false;
+
+        makeNameKey(mNext.Name(), mOrder, mKey);
+        if (compareNameKeys(mKey, mPreviousKey) <= 0)
+        {
+            // Data are not sorted get out
+            cerr << "Error: Please sort the entries of your BAM files by names. 3" << endl;
+            cerr << mNext.Name() << "\t" << nameOfKey(mPreviousKey, mOrder) << endl;
+            return false;
+        }
+        NameGroup group = {
+            batch.mNumRecords, 1, false, batch.Keys.size(), mKey.size(), mNextOffset};
+        batch.Keys += mKey;
+        mPreviousKey.swap(mKey);
+
+        BamRecord &first = batch.AddRecord();
+        swap(first, mNext);
+        if (first.IsPaired())
+        {
+            // Load second mate
+            mNextOffset = mFile.Tell();
+            if (!mFile.GetNextAlignmentCore(mNext))
+            {
+                mEof = true;
+                group.Truncated = true;
+            }
+            else if (strcmp(mNext.Name(), first.Name()) == 0)
+            {
+                swap(batch.AddRecord(), mNext);
+                group.Count = 2;
+            }
+            else
+            {
+                mHasNext = true;
+            }
+        }
+        batch.Groups.push_back(group);
+    }
+    batch.EndOffset = mHasNext ? mNextOffset : mEof ? UINT64_MAX : mFile.Tell();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    mSeconds += elapsed.count();
+
+    if (mFile.HasError())
+    {
+        cerr << "Error: Could not read inputfile " << mFileNumber << "." << endl;
+        return false;
+    }
+    return true;
+}
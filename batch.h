@@ -0,0 +1,91 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+
+#include "bamio.h"
+#include "namekey.h"
+#include "queue.h"
+
+// Number of name groups read from each input at a time by the sorted merge
+const size_t MERGE_BATCH_GROUPS = 4096;
+
+// Records of one read name in a file sorted by names: a single-end read, both mates of a pair, or
+// a mate whose pair is missing
+struct NameGroup
+{
+    size_t First; // index of the first record in GroupBatch::Records
+    int Count;
+    bool Truncated;   // paired read whose mate is missing because the file ended
+    size_t KeyOffset; // sort key of the name: GroupBatch::Keys[KeyOffset, KeyOffset + KeySize)
+    size_t KeySize;
+    uint64_t Offset; // virtual offset of the first record in the file, to resume from
+};
+
+// Consecutive name groups of one input. The records are read into slots that are kept from one
+// batch to the next, so that their buffers are reused instead of reallocated.
+class GroupBatch
+{
+public:
+    GroupBatch();
+
+    void Clear();
+    bool Empty() const;
+    BamRecord &AddRecord(); // next free slot
+    // Sort key of the name of a group
+    const char *Key(const NameGroup &group) const;
+
+    std::vector<BamRecord> Records;
+    std::vector<NameGroup> Groups;
+    std::string Keys;   // of all the groups, one after the other
+    uint64_t EndOffset; // virtual offset of the group after the batch, UINT64_MAX at the end
+
+private:
+    friend class GroupReader;
+
+    size_t mNumRecords;
+};
+
+// Splits an input sorted by names into batches of name groups, checking the order of the names
+// through their sort keys. With a queue depth, the batches are read ahead by a thread of the
+// reader, up to queueDepth batches in advance. When a merge resumes from a checkpoint, lastName is
+// the last name merged before, which all the names read must follow.
+class GroupReader
+{
+public:
+    GroupReader(BamInput &file,
+                int fileNumber,
+                size_t batchGroups,
+                NameOrder order,
+                size_t queueDepth = 0,
+                const std::string &lastName = std::string());
+    ~GroupReader();
+
+    // Read the next batchGroups name groups into batch (an empty batch at the end of the file).
+    // Returns false (after printing an error message) if the file is not sorted or cannot be read.
+    bool ReadBatch(GroupBatch &batch);
+    // Time spent reading and decoding the records so far
+    double Seconds() const;
+
+private:
+    bool FillBatch(GroupBatch &batch);
+    void ReadAhead();
+
+    BamInput &mFile;
+    const int mFileNumber;
+    const size_t mBatchGroups;
+    const NameOrder mOrder;
+    BamRecord mNext;      // first record of the next group
+    uint64_t mNextOffset; // virtual offset of mNext
+    bool mHasNext;
+    bool mEof;
+    std::string mKey;         // of the name of mNext
+    std::string mPreviousKey; // of the name of the last group
+    double mSeconds;
+
+    SpscQueue<GroupBatch> *mQueue; // nullptr: batches are read by ReadBatch()
+    std::thread mThread;
+};
+
+#endif
@@ -0,0 +1,629 @@
+// Benchmark of the stages of bam-mergeRef on a synthetic pair of BAM files sorted by names.
+// Reports the records/s, MB/s, peak RSS and heap allocations per record of each stage as JSON, so
+// that the numbers of two builds can be compared.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <popt.h>
+#include <random>
+#include <sstream>
+#include <sys/resource.h>
+
+#include "bamio.h"
+#include "batch.h"
+#include "header.h"
+#include "merge.h"
+
+using namespace std;
+using namespace BamTools;
+
+// Heap allocations of the whole process, counted by the replaced operators new. The whole set of
+// operators is replaced, all of them on malloc() and free(), so that GCC pairs them.
+static atomic<uint64_t> numAllocations(0);
+
+static void *allocate(size_t size)
+{
+    numAllocations.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+        throw bad_alloc();
+    return p;
+}
+
+void *operator new(size_t size)
+{
+    return allocate(size);
+}
+
+void *operator new[](size_t size)
+{
+    return allocate(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+struct GeneratorOptions
+{
+    long NumNames;
+    double Paired;     // fraction of names that are pairs
+    double Mapped;     // probability that a read is mapped in one file
+    double Discordant; // fraction of reads mapped in both files at different positions
+    int ReadLength;
+    int NumTags; // optional fields per record
+    long Seed;
+};
+
+struct StageResult
+{
+    string Name;
+    uint64_t Records;
+    uint64_t Bytes;
+    double Seconds;
+    long PeakRss; // kB
+    uint64_t Allocations;
+};
+
+static const int NUM_REFERENCES = 25;
+static const int32_t REFERENCE_LENGTH = 100000000;
+
+static void appendInt32(string &buffer, int32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        buffer += (char)((value >> (8 * i)) & 0xff);
+}
+
+static void appendUint16(string &buffer, uint16_t value)
+{
+    buffer += (char)(value & 0xff);
+    buffer += (char)(value >> 8);
+}
+
+static string headerText(int fileNumber)
+{
+    ostringstream header;
+    header << "@HD\tVN:1.4\tSO:queryname\n";
+    for (int i = 0; i < NUM_REFERENCES; i++)
+        header << "@SQ\tSN:chr" << i + 1 << "\tLN:" << REFERENCE_LENGTH << "\n";
+    header << "@RG\tID:lib" << fileNumber << "\tSM:sample\n";
+    header << "@PG\tID:bwa\tPN:bwa\tVN:0.7.17\n";
+    header << "@PG\tID:sort" << fileNumber << "\tPN:samtools\tPP:bwa\n";
+    return header.str();
+}
+
+// Raw record (without its block_size) with a single-operation CIGAR
+static void encodeRecord(string &raw,
+                         const string &name,
+                         uint16_t flag,
+                         int32_t refID,
+                         int32_t position,
+                         const GeneratorOptions &options,
+                         mt19937_64 &generator)
+{
+    const int length = options.ReadLength;
+    const bool mapped = (flag & 0x4) == 0;
+    raw.clear();
+    appendInt32(raw, mapped ? refID : -1);
+    appendInt32(raw, mapped ? position : -1);
+    raw += (char)(name.size() + 1);
+    raw += (char)(mapped ? 37 : 0);
+    appendUint16(raw, 4680); // bin, unchecked
+    appendUint16(raw, mapped ? 1 : 0);
+    appendUint16(raw, flag);
+    appendInt32(raw, length);
+    appendInt32(raw, -1);
+    appendInt32(raw, -1);
+    appendInt32(raw, 0);
+    raw += name;
+    raw += '\0';
+    if (mapped)
+        appendInt32(raw, length << 4); // M
+    for (int i = 0; i < (length + 1) / 2; i++)
+        raw += (char)((1 << (generator() % 4)) << 4 | 1 << (generator() % 4)); // two of A, C, G, T
+    for (int i = 0; i < length; i++)
+        raw += (char)(2 + generator() % 39);
+    for (int i = 0; i < options.NumTags; i++)
+    {
+        raw += 'X';
+        raw += (char)('A' + i % 26);
+        raw += 'Z';
+        for (int j = 0; j < 15; j++)
+            raw += (char)('a' + generator() % 26);
+        raw += '\0';
+    }
+}
+
+// Write two BAM files sorted by names. Returns the number of records of each file.
+static bool generateInputs(const string &filename1,
+                           const string &filename2,
+                           const GeneratorOptions &options,
+                           uint64_t numRecords[2])
+{
+    RefVector references;
+    for (int i = 0; i < NUM_REFERENCES; i++)
+        references.push_back(RefData("chr" + to_string(i + 1), REFERENCE_LENGTH));
+
+    BamOutput files[2];
+    if (!files[0].Open(filename1, headerText(1), references, Z_DEFAULT_COMPRESSION)
+        || !files[1].Open(filename2, headerText(2), references, Z_DEFAULT_COMPRESSION))
+    {
+        cerr << "Error: Could not write the generated input files." << endl;
+        return false;
+    }
+
+    mt19937_64 generator(options.Seed);
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+    string raw;
+    BamRecord rec;
+    char name[32];
+    numRecords[0] = numRecords[1] = 0;
+    for (long n = 0; n < options.NumNames; n++)
+    {
+        snprintf(name, sizeof(name), "SIM:1:%09ld", n);
+        const bool paired = uniform(generator) < options.Paired;
+        const int32_t refID = generator() % NUM_REFERENCES;
+        const int32_t position = generator() % (REFERENCE_LENGTH - 1000);
+        bool mapped[2] = {uniform(generator) < options.Mapped, uniform(generator) < options.Mapped};
+        const bool discordant = uniform(generator) < options.Discordant;
+
+        for (int side = 0; side < 2; side++)
+        {
+            for (int mate = 0; mate < (paired ? 2 : 1); mate++)
+            {
+                uint16_t flag = mapped[side] ? 0 : 0x4;
+                if (paired)
+                    flag |= 0x1 | (mate == 0 ? 0x40 : 0x80);
+                int32_t matePosition = position + mate * 300 + (side == 1 && discordant ? 5000 : 0);
+                encodeRecord(raw, name, flag, refID, matePosition, options, generator);
+                rec.SetRawData(raw.data(), raw.size());
+                files[side].SaveAlignment(rec);
+                numRecords[side]++;
+            }
+        }
+    }
+
+    if (!files[0].Close() || !files[1].Close())
+    {
+        cerr << "Error: Could not write the generated input files." << endl;
+        return false;
+    }
+    return true;
+}
+
+// Peak RSS since the last call, in kB. Falls back on the peak of the whole process if the kernel
+// cannot reset it.
+static long peakRss(bool reset)
+{
+    long peak = -1;
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            peak = atol(line.c_str() + 6);
+    if (peak < 0)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        peak = usage.ru_maxrss;
+    }
+    if (reset)
+    {
+        ofstream clearRefs("/proc/self/clear_refs");
+        clearRefs << "5" << endl;
+    }
+    return peak;
+}
+
+class Stage
+{
+public:
+    explicit Stage(const string &name)
+    {
+        mResult.Name = name;
+        peakRss(true);
+        mAllocations = numAllocations.load();
+        mStart = chrono::steady_clock::now();
+    }
+
+    StageResult Stop(uint64_t records, uint64_t bytes)
+    {
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - mStart;
+        mResult.Seconds = elapsed.count();
+        mResult.Allocations = numAllocations.load() - mAllocations;
+        mResult.PeakRss = peakRss(false);
+        mResult.Records = records;
+        mResult.Bytes = bytes;
+        return mResult;
+    }
+
+private:
+    StageResult mResult;
+    uint64_t mAllocations;
+    chrono::steady_clock::time_point mStart;
+};
+
+// Merge the headers of the generated files (repeated, since one merge is short)
+static StageResult benchHeader(BamInput &file1, BamInput &file2, int argc, const char *argv[])
+{
+    const int repeats = 1000;
+    mt19937_64 generator(1);
+    string textHeaderOut;
+    RefVector referencesOut;
+    vector<vector<int32_t>> refIDMaps;
+    uint64_t lines = 0;
+    for (char c : file1.GetHeaderText() + file2.GetHeaderText())
+        lines += c == '\n';
+
+    Stage stage("header");
+    for (int i = 0; i < repeats; i++)
+        mergeHeaders({&file1, &file2},
+                     {"refA", "refB"},
+                     false,
+                     argc,
+                     argv,
+                     generator,
+                     textHeaderOut,
+                     referencesOut,
+                     refIDMaps);
+    return stage.Stop(lines * repeats,
+                      (file1.GetHeaderText().size() + file2.GetHeaderText().size()) * repeats);
+}
+
+// Read and decode all the records of both files, grouped by names as for the merge
+static StageResult benchRead(BamInput *files[2], vector<GroupBatch> batches[2])
+{
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    Stage stage("read");
+    for (int side = 0; side < 2; side++)
+    {
+        GroupReader reader(*files[side], side + 1, MERGE_BATCH_GROUPS, NAME_ORDER_NATURAL);
+        while (1)
+        {
+            batches[side].emplace_back();
+            GroupBatch &batch = batches[side].back();
+            if (!reader.ReadBatch(batch))
+                exit(1);
+            if (batch.Empty())
+            {
+                batches[side].pop_back();
+                break;
+            }
+            for (auto &group : batch.Groups)
+            {
+                for (int i = 0; i < group.Count; i++)
+                    bytes += 4 + batch.Records[group.First + i].RawData().size();
+                records += group.Count;
+            }
+        }
+    }
+    return stage.Stop(records, bytes);
+}
+
+// Position in the name groups of one file
+class GroupCursor
+{
+public:
+    explicit GroupCursor(vector<GroupBatch> &batches) : mBatches(batches), mBatch(0), mGroup(0)
+    {
+    }
+
+    bool End() const
+    {
+        return mBatch == mBatches.size();
+    }
+
+    const NameGroup &Group() const
+    {
+        return mBatches[mBatch].Groups[mGroup];
+    }
+
+    BamRecord *Records() const
+    {
+        return mBatches[mBatch].Records.data() + Group().First;
+    }
+
+    // Order of the names of the current groups of two cursors, compared through their keys
+    int Compare(const GroupCursor &other) const
+    {
+        return compareNameKeys(mBatches[mBatch].Key(Group()),
+                               Group().KeySize,
+                               other.mBatches[other.mBatch].Key(other.Group()),
+                               other.Group().KeySize);
+    }
+
+    void Next()
+    {
+        if (++mGroup == mBatches[mBatch].Groups.size())
+        {
+            mBatch++;
+            mGroup = 0;
+        }
+    }
+
+private:
+    vector<GroupBatch> &mBatches;
+    size_t mBatch;
+    size_t mGroup;
+};
+
+// Take the merge decisions for the records held in memory, the names compared through their keys
+// as by mergeSortedFiles(). The kept records are encoded into uncompressed outputs written to
+// /dev/null, the cost of deflate is measured by the write stage.
+static StageResult benchDecide(vector<GroupBatch> batches[2])
+{
+    BamOutput outFile;
+    BamOutput trashFile;
+    RefVector references;
+    if (!outFile.Open("/dev/null", "", references, Z_NO_COMPRESSION)
+        || !trashFile.Open("/dev/null", "", references, Z_NO_COMPRESSION))
+    {
+        cerr << "Error: Could not write /dev/null." << endl;
+        exit(1);
+    }
+    MergeOutput output = {&outFile, &trashFile, nullptr, nullptr};
+
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    GroupCursor cursor1(batches[0]);
+    GroupCursor cursor2(batches[1]);
+
+    Stage stage("decide");
+    while (!cursor1.End() || !cursor2.End())
+    {
+        int order;
+        if (cursor1.End())
+            order = 1;
+        else if (cursor2.End())
+            order = -1;
+        else
+            order = cursor1.Compare(cursor2);
+
+        BamRecord *records1 = order <= 0 ? cursor1.Records() : nullptr;
+        BamRecord *records2 = order >= 0 ? cursor2.Records() : nullptr;
+        BamRecord *group1[2] = {records1, records1 + 1};
+        BamRecord *group2[2] = {records2, records2 + 1};
+        const int n1 = order <= 0 ? cursor1.Group().Count : 0;
+        const int n2 = order >= 0 ? cursor2.Group().Count : 0;
+        for (int i = 0; i < n1; i++)
+            bytes += 4 + records1[i].RawData().size();
+        for (int i = 0; i < n2; i++)
+            bytes += 4 + records2[i].RawData().size();
+        records += n1 + n2;
+
+        mergeRecords(group1, n1, group2, n2, output);
+        if (n1 > 0)
+            cursor1.Next();
+        if (n2 > 0)
+            cursor2.Next();
+    }
+    outFile.Close();
+    trashFile.Close();
+    return stage.Stop(records, bytes);
+}
+
+// Encode, compress and write the records of file 1
+static StageResult benchWrite(const string &filename,
+                              vector<GroupBatch> &batches,
+                              BamInput &file,
+                              BgzfPool *pool,
+                              size_t queueDepth)
+{
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    Stage stage("write");
+    BamOutput outFile;
+    if (!outFile.Open(filename,
+                      file.GetHeaderText(),
+                      file.GetReferenceData(),
+                      Z_DEFAULT_COMPRESSION,
+                      pool,
+                      queueDepth))
+    {
+        cerr << "Error: Could not write " << filename << "." << endl;
+        exit(1);
+    }
+    for (auto &batch : batches)
+    {
+        for (auto &group : batch.Groups)
+        {
+            for (int i = 0; i < group.Count; i++)
+            {
+                outFile.SaveAlignment(batch.Records[group.First + i]);
+                bytes += 4 + batch.Records[group.First + i].RawData().size();
+            }
+            records += group.Count;
+        }
+        outFile.Flush();
+    }
+    outFile.Close();
+    return stage.Stop(records, bytes);
+}
+
+// The whole merge of the files, as run by bam-mergeRef
+static StageResult benchMerge(const string inputs[2],
+                              const string &outName,
+                              const string &trashName,
+                              BgzfPool *pool,
+                              size_t queueDepth,
+                              uint64_t records,
+                              uint64_t bytes)
+{
+    Stage stage("merge");
+    BamInput file1;
+    BamInput file2;
+    BamOutput outFile;
+    BamOutput trashFile;
+    if (!file1.Open(inputs[0]) || !file2.Open(inputs[1]))
+    {
+        cerr << "Error: Could not read the generated input files." << endl;
+        exit(1);
+    }
+    if (!outFile.Open(outName,
+                      file1.GetHeaderText(),
+                      file1.GetReferenceData(),
+                      Z_DEFAULT_COMPRESSION,
+                      pool,
+                      queueDepth)
+        || !trashFile.Open(trashName,
+                           file1.GetHeaderText(),
+                           file1.GetReferenceData(),
+                           Z_DEFAULT_COMPRESSION,
+                           pool,
+                           queueDepth))
+    {
+        cerr << "Error: Could not write " << outName << " and " << trashName << "." << endl;
+        exit(1);
+    }
+    MergeOutput output = {&outFile, &trashFile, nullptr, nullptr};
+    // The warnings about missing mates are not part of the measure
+    streambuf *coutBuffer = cout.rdbuf(nullptr);
+    bool ok = mergeSortedFiles({&file1, &file2}, output, queueDepth);
+    cout.rdbuf(coutBuffer);
+    file1.Close();
+    file2.Close();
+    ok = outFile.Close() && trashFile.Close() && ok;
+    if (!ok)
+        exit(1);
+    return stage.Stop(records, bytes);
+}
+
+static void printJson(ostream &out,
+                      const GeneratorOptions &options,
+                      int numThreads,
+                      int queueDepth,
+                      const uint64_t numRecords[2],
+                      const vector<StageResult> &results)
+{
+    out << "{\n";
+    out << "  \"generator\": {\"names\": " << options.NumNames << ", \"paired\": " << options.Paired
+        << ", \"mapped\": " << options.Mapped << ", \"discordant\": " << options.Discordant
+        << ", \"read_length\": " << options.ReadLength << ", \"tags\": " << options.NumTags
+        << ", \"seed\": " << options.Seed << ", \"records1\": " << numRecords[0]
+        << ", \"records2\": " << numRecords[1] << "},\n";
+    out << "  \"threads\": " << numThreads << ",\n";
+    out << "  \"queue_depth\": " << queueDepth << ",\n";
+    out << "  \"stages\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const StageResult &r = results[i];
+        out << "    {\"name\": \"" << r.Name << "\", \"records\": " << r.Records
+            << ", \"bytes\": " << r.Bytes << ", \"seconds\": " << r.Seconds
+            << ", \"records_per_second\": " << (r.Seconds > 0 ? r.Records / r.Seconds : 0)
+            << ", \"mb_per_second\": " << (r.Seconds > 0 ? r.Bytes / r.Seconds / 1e6 : 0)
+            << ", \"peak_rss_kb\": " << r.PeakRss << ", \"allocations_per_record\": "
+            << (r.Records > 0 ? (double)r.Allocations / r.Records : 0) << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+int main(int argc, const char *argv[])
+{
+    GeneratorOptions options = {200000, 0.5, 0.9, 0.05, 100, 3, 1};
+    int numThreads = 0;
+    int queueDepth = 4;
+    char *directory = nullptr;
+    char *jsonFileName = nullptr;
+    int keepFiles = 0;
+
+    // clang-format off
+    struct poptOption optionsTable[] = {
+        {"names", 'n', POPT_ARG_LONG, &options.NumNames, 0, "Set number of read names (default: 200000)", "N"},
+        {"paired", '\0', POPT_ARG_DOUBLE, &options.Paired, 0, "Set fraction of paired reads (default: 0.5)", "F"},
+        {"mapped", '\0', POPT_ARG_DOUBLE, &options.Mapped, 0, "Set probability that a read is mapped in one file (default: 0.9)", "F"},
+        {"discordant", '\0', POPT_ARG_DOUBLE, &options.Discordant, 0, "Set fraction of reads mapped at different positions in both files (default: 0.05)", "F"},
+        {"length", '\0', POPT_ARG_INT, &options.ReadLength, 0, "Set read length (default: 100)", "N"},
+        {"tags", '\0', POPT_ARG_INT, &options.NumTags, 0, "Set number of optional fields per record (default: 3)", "N"},
+        {"seed", '\0', POPT_ARG_LONG, &options.Seed, 0, "Set seed of the generator (default: 1)", "N"},
+        {"threads", '@', POPT_ARG_INT, &numThreads, 0, "Set number of compression threads (default: 0)", "N"},
+        {"queue-depth", '\0', POPT_ARG_INT, &queueDepth, 0, "Set depth of the queues between threads (default: 4)", "N"},
+        {"directory", 'd', POPT_ARG_STRING, &directory, 0, "Set directory of the generated files (default: current directory)", "path"},
+        {"json", 'j', POPT_ARG_STRING, &jsonFileName, 0, "Write the results to a file instead of the standard output", "path/name"},
+        {"keep", 'k', POPT_ARG_NONE, &keepFiles, 0, "Keep the generated files", NULL},
+        POPT_AUTOHELP{NULL, 0, 0, NULL, 0}};
+    // clang-format on
+
+    poptContext optCon = poptGetContext("bam-mergeRef-bench", argc, argv, optionsTable, 0);
+    poptSetOtherOptionHelp(optCon, "[OPTIONS]*");
+    if (poptGetNextOpt(optCon) != -1 || options.NumNames < 0 || options.ReadLength <= 0
+        || options.NumTags < 0 || queueDepth < 0)
+    {
+        poptPrintUsage(optCon, stderr, 0);
+        return 1;
+    }
+
+    string prefix = string(directory != nullptr ? directory : ".") + "/bench";
+    const string inputs[2] = {prefix + "1.bam", prefix + "2.bam"};
+    const string outName = prefix + "_out.bam";
+    const string trashName = prefix + "_trash.bam";
+
+    uint64_t numRecords[2];
+    if (!generateInputs(inputs[0], inputs[1], options, numRecords))
+        return 1;
+
+    BamInput file1;
+    BamInput file2;
+    if (!file1.Open(inputs[0]) || !file2.Open(inputs[1]))
+    {
+        cerr << "Error: Could not read the generated input files." << endl;
+        return 1;
+    }
+    BamInput *files[2] = {&file1, &file2};
+    BgzfPool *pool = numThreads > 0 ? new BgzfPool(numThreads) : nullptr;
+
+    vector<StageResult> results;
+    vector<GroupBatch> batches[2];
+    setMergeSeed(options.Seed);
+    results.push_back(benchHeader(file1, file2, argc, argv));
+    results.push_back(benchRead(files, batches));
+    results.push_back(benchDecide(batches));
+    results.push_back(benchWrite(outName, batches[0], file1, pool, queueDepth));
+    batches[0].clear();
+    batches[1].clear();
+    file1.Close();
+    file2.Close();
+    const StageResult &read = results[1];
+    results.push_back(
+        benchMerge(inputs, outName, trashName, pool, queueDepth, read.Records, read.Bytes));
+    delete pool;
+
+    if (jsonFileName != nullptr)
+    {
+        ofstream json(jsonFileName);
+        printJson(json, options, numThreads, queueDepth, numRecords, results);
+    }
+    else
+    {
+        printJson(cout, options, numThreads, queueDepth, numRecords, results);
+    }
+
+    if (!keepFiles)
+        for (const string &name : {inputs[0], inputs[1], outName, trashName})
+            remove(name.c_str());
+    poptFreeContext(optCon);
+    return 0;
+}
@@ -0,0 +1,888 @@
+#include "bgzf.h"
+
+#include <csignal>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+
+using namespace std;
+
+// Header of a BGZF block: gzip header with the 'BC' extra subfield holding the block size.
+static const unsigned char BGZF_HEADER[] =
+    {0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 'B', 'C', 0x02, 0x00};
+static const size_t BGZF_HEADER_SIZE = 18; // BGZF_HEADER + BSIZE
+static const size_t BGZF_FOOTER_SIZE = 8;  // CRC32 + ISIZE
+
+// Empty block marking the end of a BGZF file
+static const unsigned char BGZF_EOF[] = {0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff,
+                                         0x06, 0x00, 0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00,
+                                         0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+static void packUint16(unsigned char *dest, uint16_t value)
+{
+    dest[0] = value & 0xff;
+    dest[1] = value >> 8;
+}
+
+static void packUint32(unsigned char *dest, uint32_t value)
+{
+    dest[0] = value & 0xff;
+    dest[1] = (value >> 8) & 0xff;
+    dest[2] = (value >> 16) & 0xff;
+    dest[3] = value >> 24;
+}
+
+
+static uint32_t blockCrc32(const char *data, size_t length)
+{
+#ifdef HAVE_LIBDEFLATE
+    return libdeflate_crc32(0, data, length);
+#else
+    return crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data, length);
+#endif
+}
+
+// Deflate stream made of a single stored block, which holds up to 65535 bytes. This is what zlib
+// writes at level 0, and the fallback for incompressible data with both backends.
+static void storeBlock(const char *data, size_t length, string &block)
+{
+    block.resize(BGZF_HEADER_SIZE + 5 + length + BGZF_FOOTER_SIZE);
+    unsigned char *out = (unsigned char *)&block[BGZF_HEADER_SIZE];
+    out[0] = 1; // last block, not compressed
+    packUint16(out + 1, length);
+    packUint16(out + 3, ~length & 0xffff);
+    memcpy(out + 5, data, length);
+}
+
+#ifdef HAVE_LIBDEFLATE
+BgzfCompressor::BgzfCompressor() : mCompressor(nullptr), mLevel(0)
+{
+}
+
+BgzfCompressor::~BgzfCompressor()
+{
+    if (mCompressor != nullptr)
+        libdeflate_free_compressor(mCompressor);
+}
+#else
+BgzfCompressor::BgzfCompressor() : mInitialized(false), mLevel(0)
+{
+    memset(&mStream, 0, sizeof(mStream));
+}
+
+BgzfCompressor::~BgzfCompressor()
+{
+    if (mInitialized)
+        deflateEnd(&mStream);
+}
+#endif
+
+bool BgzfCompressor::Compress(const char *data, size_t length, int level, string &block)
+{
+    if (length > BGZF_BLOCK_DATA_SIZE)
+        return false;
+    // Incompressible data is stored
+    if (level == Z_NO_COMPRESSION || !Deflate(data, length, level, block))
+        storeBlock(data, length, block);
+
+    unsigned char *out = (unsigned char *)&block[0];
+    memcpy(out, BGZF_HEADER, sizeof(BGZF_HEADER));
+    packUint16(out + 16, block.size() - 1);
+
+    packUint32(out + block.size() - 8, blockCrc32(data, length));
+    packUint32(out + block.size() - 4, length);
+    return true;
+}
+
+#ifdef HAVE_LIBDEFLATE
+bool BgzfCompressor::Deflate(const char *data, size_t length, int level, string &block)
+{
+    if (mCompressor == nullptr || level != mLevel)
+    {
+        if (mCompressor != nullptr)
+            libdeflate_free_compressor(mCompressor);
+        mCompressor = libdeflate_alloc_compressor(level == Z_DEFAULT_COMPRESSION ? 6 : level);
+        if (mCompressor == nullptr)
+            return false;
+        mLevel = level;
+    }
+
+    block.resize(BGZF_MAX_BLOCK_SIZE);
+    const size_t size = libdeflate_deflate_compress(mCompressor,
+                                                    data,
+                                                    length,
+                                                    &block[BGZF_HEADER_SIZE],
+                                                    BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE
+                                                        - BGZF_FOOTER_SIZE);
+    if (size == 0)
+        return false;
+    block.resize(BGZF_HEADER_SIZE + size + BGZF_FOOTER_SIZE);
+    return true;
+}
+#else
+bool BgzfCompressor::Deflate(const char *data, size_t length, int level, string &block)
+{
+    if (!mInitialized || level != mLevel)
+    {
+        if (mInitialized)
+            deflateEnd(&mStream);
+        mInitialized = false;
+        // Raw deflate stream (negative window bits), the gzip wrapper is written by hand
+        if (deflateInit2(&mStream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        mInitialized = true;
+        mLevel = level;
+    }
+    else if (deflateReset(&mStream) != Z_OK)
+    {
+        return false;
+    }
+
+    block.resize(BGZF_MAX_BLOCK_SIZE);
+    mStream.next_in = (Bytef *)data;
+    mStream.avail_in = length;
+    mStream.next_out = (Bytef *)&block[BGZF_HEADER_SIZE];
+    mStream.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    if (deflate(&mStream, Z_FINISH) != Z_STREAM_END)
+        return false;
+
+    block.resize(BGZF_HEADER_SIZE + mStream.total_out + BGZF_FOOTER_SIZE);
+    return true;
+}
+#endif
+
+
+#ifdef HAVE_LIBDEFLATE
+BgzfDecompressor::BgzfDecompressor() : mDecompressor(nullptr)
+{
+}
+
+BgzfDecompressor::~BgzfDecompressor()
+{
+    if (mDecompressor != nullptr)
+        libdeflate_free_decompressor(mDecompressor);
+}
+
+bool BgzfDecompressor::Inflate(const unsigned char *stream,
+                               size_t streamLength,
+                               char *data,
+                               size_t length)
+{
+    if (mDecompressor == nullptr)
+        mDecompressor = libdeflate_alloc_decompressor();
+    return mDecompressor != nullptr
+           && libdeflate_deflate_decompress(
+                  mDecompressor, stream, streamLength, data, length, nullptr)
+                  == LIBDEFLATE_SUCCESS;
+}
+#else
+BgzfDecompressor::BgzfDecompressor() : mInitialized(false)
+{
+    memset(&mStream, 0, sizeof(mStream));
+}
+
+BgzfDecompressor::~BgzfDecompressor()
+{
+    if (mInitialized)
+        inflateEnd(&mStream);
+}
+
+bool BgzfDecompressor::Inflate(const unsigned char *stream,
+                               size_t streamLength,
+                               char *data,
+                               size_t length)
+{
+    if (!mInitialized)
+    {
+        // Raw deflate stream, the gzip wrapper of the block has been checked by the reader
+        if (inflateInit2(&mStream, -15) != Z_OK)
+            return false;
+        mInitialized = true;
+    }
+    else if (inflateReset(&mStream) != Z_OK)
+    {
+        return false;
+    }
+    mStream.next_in = (Bytef *)stream;
+    mStream.avail_in = streamLength;
+    mStream.next_out = (Bytef *)data;
+    mStream.avail_out = length;
+    return inflate(&mStream, Z_FINISH) == Z_STREAM_END && mStream.total_out == length;
+}
+#endif
+
+
+BgzfPool::BgzfPool(int numThreads) : mStop(false)
+{
+    for (int i = 0; i < numThreads; i++)
+        mThreads.push_back(thread(&BgzfPool::Work, this));
+}
+
+BgzfPool::~BgzfPool()
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStop = true;
+    }
+    mCondition.notify_all();
+    for (auto &t : mThreads)
+        t.join();
+}
+
+void BgzfPool::Submit(Job *job)
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mJobs.push_back(job);
+    }
+    mCondition.notify_one();
+}
+
+int BgzfPool::Size() const
+{
+    return mThreads.size();
+}
+
+void BgzfPool::Work()
+{
+    BgzfCompressor compressor;
+    while (1)
+    {
+        Job *job;
+        {
+            unique_lock<mutex> lock(mMutex);
+            mCondition.wait(lock, [this] { return mStop || !mJobs.empty(); });
+            if (mJobs.empty()) // mStop
+                return;
+            job = mJobs.front();
+            mJobs.pop_front();
+        }
+        if (!compressor.Compress(
+                job->Data.data(), job->Data.size(), job->Writer->mLevel, job->Block))
+            job->Block.clear();
+        job->Writer->BlockDone(job);
+    }
+}
+
+
+BgzfWriter::BgzfWriter() :
+    mFile(nullptr),
+    mCommand(false),
+    mLevel(Z_DEFAULT_COMPRESSION),
+    mPool(nullptr),
+    mError(false),
+    mFileSize(0),
+    mCurrent(nullptr),
+    mNextIndex(0),
+    mNextWrite(0),
+    mInFlight(0),
+    mMaxInFlight(0)
+{
+}
+
+BgzfWriter::~BgzfWriter()
+{
+    if (IsOpen())
+        Close();
+    for (auto job : mJobs)
+        delete job;
+}
+
+bool BgzfWriter::Open(const string &filename, int compressionLevel, BgzfPool *pool)
+{
+    mFile = filename == "-" ? stdout : fopen(filename.c_str(), "wb");
+    if (mFile == nullptr)
+        return false;
+    mCommand = false;
+    Start(compressionLevel, pool);
+    return true;
+}
+
+bool BgzfWriter::OpenCommand(const string &command, int compressionLevel, BgzfPool *pool)
+{
+    // A command exiting early makes the writes fail instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+    mFile = popen(command.c_str(), "w");
+    if (mFile == nullptr)
+        return false;
+    mCommand = true;
+    Start(compressionLevel, pool);
+    return true;
+}
+
+bool BgzfWriter::Resume(const string &filename,
+                        uint64_t size,
+                        int compressionLevel,
+                        BgzfPool *pool)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0 || (uint64_t)st.st_size < size
+        || truncate(filename.c_str(), size) != 0)
+        return false;
+    mFile = fopen(filename.c_str(), "ab");
+    if (mFile == nullptr)
+        return false;
+    mCommand = false;
+    Start(compressionLevel, pool);
+    mFileSize = size;
+    return true;
+}
+
+void BgzfWriter::Start(int compressionLevel, BgzfPool *pool)
+{
+    mLevel = compressionLevel;
+    mPool = pool;
+    mError = false;
+    mBlockOffsets.clear();
+    mFileSize = 0;
+    if (mPool == nullptr)
+    {
+        mData.reserve(BGZF_BLOCK_DATA_SIZE);
+    }
+    else
+    {
+        // Enough blocks to keep every worker busy while the next ones are being filled
+        mMaxInFlight = 4 * mPool->Size();
+        mNextIndex = 0;
+        mNextWrite = 0;
+        mInFlight = 0;
+        mCurrent = new BgzfPool::Job;
+        mCurrent->Writer = this;
+        mCurrent->Data.reserve(BGZF_BLOCK_DATA_SIZE);
+        mJobs.push_back(mCurrent);
+    }
+}
+
+bool BgzfWriter::IsOpen() const
+{
+    return mFile != nullptr;
+}
+
+bool BgzfWriter::Write(const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        string &buffer = (mPool == nullptr) ? mData : mCurrent->Data;
+        size_t n = min(length, BGZF_BLOCK_DATA_SIZE - buffer.size());
+        buffer.append(data, n);
+        data += n;
+        length -= n;
+        if (buffer.size() == BGZF_BLOCK_DATA_SIZE && !FlushBlock())
+            return false;
+    }
+    return !mError;
+}
+
+bool BgzfWriter::FlushBlock()
+{
+    if (mPool == nullptr)
+    {
+        if (mData.empty())
+            return true;
+        if (!mCompressor.Compress(mData.data(), mData.size(), mLevel, mBlock))
+            mError = true;
+        else
+            WriteBlock(mBlock);
+        mData.clear();
+        return !mError;
+    }
+
+    if (mCurrent->Data.empty())
+        return true;
+
+    BgzfPool::Job *job = mCurrent;
+    job->Index = mNextIndex++;
+    {
+        unique_lock<mutex> lock(mMutex);
+        // Back-pressure: wait for the workers if too many blocks are in flight
+        mCondition.wait(lock, [this] { return !mFree.empty() || mJobs.size() < mMaxInFlight; });
+        mInFlight++;
+        if (!mFree.empty())
+        {
+            mCurrent = mFree.back();
+            mFree.pop_back();
+        }
+        else
+        {
+            mCurrent = new BgzfPool::Job;
+            mCurrent->Writer = this;
+            mCurrent->Data.reserve(BGZF_BLOCK_DATA_SIZE);
+            mJobs.push_back(mCurrent);
+        }
+    }
+    mPool->Submit(job);
+    return !mError;
+}
+
+bool BgzfWriter::WriteBlock(const string &block)
+{
+    mBlockOffsets.push_back(mFileSize);
+    mFileSize += block.size();
+    if (fwrite(block.data(), 1, block.size(), mFile) != block.size())
+        mError = true;
+    return !mError;
+}
+
+const vector<uint64_t> &BgzfWriter::BlockOffsets() const
+{
+    return mBlockOffsets;
+}
+
+// Called by the worker threads. Blocks are written as soon as all the blocks filled before them
+// have been written.
+void BgzfWriter::BlockDone(BgzfPool::Job *job)
+{
+    lock_guard<mutex> lock(mMutex);
+    mDone[job->Index] = job;
+    map<uint64_t, BgzfPool::Job *>::iterator it;
+    while ((it = mDone.find(mNextWrite)) != mDone.end())
+    {
+        BgzfPool::Job *done = it->second;
+        if (done->Block.empty())
+            mError = true;
+        else
+            WriteBlock(done->Block);
+        done->Data.clear();
+        mFree.push_back(done);
+        mDone.erase(it);
+        mNextWrite++;
+        mInFlight--;
+    }
+    mCondition.notify_all();
+}
+
+bool BgzfWriter::Sync(uint64_t &fileSize)
+{
+    if (mFile == nullptr || mCommand)
+        return false;
+
+    // A checkpoint must not count blocks that failed to be written
+    const bool flushed = FlushBlock();
+    unique_lock<mutex> lock(mMutex);
+    if (mPool != nullptr)
+        mCondition.wait(lock, [this] { return mInFlight == 0; });
+    if (!flushed || fflush(mFile) != 0 || fsync(fileno(mFile)) != 0)
+        mError = true;
+    fileSize = mFileSize;
+    return !mError;
+}
+
+bool BgzfWriter::Close()
+{
+    if (mFile == nullptr)
+        return false;
+
+    // The file is closed even if the last block could not be written
+    const bool flushed = FlushBlock();
+    if (mPool != nullptr)
+    {
+        unique_lock<mutex> lock(mMutex);
+        mCondition.wait(lock, [this] { return mInFlight == 0; });
+    }
+    if (!flushed)
+        mError = true;
+
+    mBlockOffsets.push_back(mFileSize);
+    if (fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), mFile) != sizeof(BGZF_EOF))
+        mError = true;
+    if (mCommand ? pclose(mFile) != 0 : (mFile == stdout ? fflush(mFile) : fclose(mFile)) != 0)
+        mError = true;
+    mFile = nullptr;
+    return !mError;
+}
+
+
+BgzfReader::BgzfReader() :
+    mFile(nullptr),
+    mCommand(false),
+    mCommandDone(false),
+    mMap(nullptr),
+    mMapSize(0),
+    mMapPosition(0),
+    mHead(0),
+    mCount(0),
+    mPosition(0),
+    mAvailable(false),
+    mEof(false),
+    mStop(false),
+    mError(false)
+{
+}
+
+BgzfReader::~BgzfReader()
+{
+    if (IsOpen())
+        Close();
+}
+
+bool BgzfReader::Open(const string &filename, size_t readAhead)
+{
+    mFile = filename == "-" ? stdin : fopen(filename.c_str(), "rb");
+    if (mFile == nullptr)
+        return false;
+    mCommand = false;
+    MapFile();
+    Start(readAhead);
+    return true;
+}
+
+bool BgzfReader::OpenCommand(const string &command, size_t readAhead)
+{
+    mFile = popen(command.c_str(), "r");
+    if (mFile == nullptr)
+        return false;
+    mCommand = true;
+    mCommandDone = false;
+    Start(readAhead);
+    return true;
+}
+
+void BgzfReader::Start(size_t readAhead)
+{
+    mBlocks.assign(max(readAhead, (size_t)2), string());
+    mOffsets.assign(mBlocks.size(), 0);
+    mError = false;
+    StartPrefetch();
+}
+
+// Map a regular file of a local filesystem in memory. Pipes cannot be mapped, and files of
+// network filesystems may change under the mapping.
+bool BgzfReader::MapFile()
+{
+    const int fd = fileno(mFile);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return false;
+#ifdef __linux__
+    struct statfs fs;
+    if (fstatfs(fd, &fs) != 0)
+        return false;
+    switch ((unsigned long)fs.f_type)
+    {
+    case 0x6969:     // NFS
+    case 0x517b:     // SMB
+    case 0xfe534d42: // SMB2
+    case 0xff534d42: // CIFS
+    case 0x65735546: // FUSE
+        return false;
+    }
+#endif
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    mMap = (const unsigned char *)map;
+    mMapSize = st.st_size;
+    mMapPosition = 0;
+    return true;
+}
+
+// Start reading blocks from the current position of the file into an empty ring buffer
+void BgzfReader::StartPrefetch()
+{
+    mHead = 0;
+    mCount = 0;
+    mPosition = 0;
+    mAvailable = false;
+    mEof = false;
+    mStop = false;
+    mThread = thread(&BgzfReader::Prefetch, this);
+}
+
+void BgzfReader::StopPrefetch()
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStop = true;
+    }
+    mCondition.notify_all();
+    mThread.join();
+}
+
+bool BgzfReader::IsOpen() const
+{
+    return mFile != nullptr;
+}
+
+bool BgzfReader::HasError() const
+{
+    return mError;
+}
+
+bool BgzfReader::Close()
+{
+    if (mFile == nullptr)
+        return false;
+
+    StopPrefetch();
+    if (mMap != nullptr)
+        munmap((void *)mMap, mMapSize);
+    mMap = nullptr;
+    // A command stopped before the end of its output fails, but the reader chose to stop
+    if (mCommand)
+    {
+        if (!mCommandDone)
+            pclose(mFile);
+    }
+    else if (mFile != stdin)
+        fclose(mFile);
+    mFile = nullptr;
+    mBlocks.clear();
+    return !mError;
+}
+
+uint64_t BgzfReader::Tell()
+{
+    if (!mAvailable || mPosition == mBlocks[mHead].size())
+    {
+        if (!NextBlock())
+            return UINT64_MAX;
+    }
+    return mOffsets[mHead] << 16 | mPosition;
+}
+
+bool BgzfReader::Seek(uint64_t virtualOffset)
+{
+    if (mFile == nullptr)
+        return false;
+    if (mCommand)
+    {
+        mError = true;
+        return false;
+    }
+
+    StopPrefetch();
+    const bool end = virtualOffset == UINT64_MAX;
+    if (mMap != nullptr)
+    {
+        if (!end && (virtualOffset >> 16) > mMapSize)
+        {
+            mError = true;
+            return false;
+        }
+        mMapPosition = end ? mMapSize : virtualOffset >> 16;
+    }
+    else
+    {
+        clearerr(mFile);
+        if (fseeko(mFile, end ? 0 : virtualOffset >> 16, end ? SEEK_END : SEEK_SET) != 0)
+        {
+            mError = true;
+            return false;
+        }
+    }
+    StartPrefetch();
+
+    const size_t position = end ? 0 : virtualOffset & 0xffff;
+    if (!NextBlock())
+        return position == 0 && !mError; // end of the file
+    if (position > mBlocks[mHead].size())
+    {
+        mError = true;
+        return false;
+    }
+    mPosition = position;
+    return true;
+}
+
+size_t BgzfReader::Read(char *data, size_t length)
+{
+    size_t copied = 0;
+    while (copied < length)
+    {
+        if (!mAvailable || mPosition == mBlocks[mHead].size())
+        {
+            if (!NextBlock())
+                break;
+            continue;
+        }
+        const string &block = mBlocks[mHead];
+        size_t n = min(length - copied, block.size() - mPosition);
+        memcpy(data + copied, block.data() + mPosition, n);
+        mPosition += n;
+        copied += n;
+    }
+    return copied;
+}
+
+// Release the block read by the consumer and wait for the next one
+bool BgzfReader::NextBlock()
+{
+    unique_lock<mutex> lock(mMutex);
+    if (mAvailable)
+    {
+        mHead = (mHead + 1) % mBlocks.size();
+        mCount--;
+        mAvailable = false;
+        mPosition = 0;
+        mCondition.notify_all();
+    }
+    mCondition.wait(lock, [this] { return mCount > 0 || mEof; });
+    if (mCount == 0)
+        return false;
+    mAvailable = true;
+    return true;
+}
+
+// Background thread filling the ring buffer
+void BgzfReader::Prefetch()
+{
+    BgzfDecompressor decompressor;
+    string compressed;
+    while (1)
+    {
+        size_t slot;
+        {
+            unique_lock<mutex> lock(mMutex);
+            mCondition.wait(lock, [this] { return mStop || mCount < mBlocks.size(); });
+            if (mStop)
+                break;
+            slot = (mHead + mCount) % mBlocks.size();
+        }
+        mOffsets[slot] = mMap != nullptr ? mMapPosition : ftello(mFile);
+        if (!ReadBlock(decompressor, compressed, mBlocks[slot]))
+        {
+            // The whole output of a command was read, its exit status tells if it is complete
+            if (mCommand && !mError)
+            {
+                if (pclose(mFile) != 0)
+                    mError = true;
+                mCommandDone = true;
+            }
+            break;
+        }
+        if (mBlocks[slot].empty()) // e.g. EOF marker
+            continue;
+        {
+            lock_guard<mutex> lock(mMutex);
+            mCount++;
+        }
+        mCondition.notify_all();
+    }
+
+    {
+        lock_guard<mutex> lock(mMutex);
+        mEof = true;
+    }
+    mCondition.notify_all();
+}
+
+// Size of the BGZF block starting at p, given in the 'BC' extra subfield of its header, or 0 if
+// the header is not valid or not complete within the available bytes
+static size_t bgzfBlockSize(const unsigned char *p, size_t available)
+{
+    if (available < 12 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 0x08 || !(p[3] & 0x04))
+        return 0;
+    const size_t extraLength = p[10] | p[11] << 8;
+    if (12 + extraLength > available)
+        return 0;
+    const unsigned char *extra = p + 12;
+    size_t blockSize = 0;
+    for (size_t i = 0; i + 4 <= extraLength; i += 4 + (extra[i + 2] | extra[i + 3] << 8))
+    {
+        if (extra[i] == 'B' && extra[i + 1] == 'C' && (extra[i + 2] | extra[i + 3] << 8) == 2
+            && i + 6 <= extraLength)
+            blockSize = (extra[i + 4] | extra[i + 5] << 8) + 1;
+    }
+    if (blockSize < 12 + extraLength + BGZF_FOOTER_SIZE)
+        return 0;
+    return blockSize;
+}
+
+// Read the next block of mFile, with its header, into compressed. Returns false at the end of the
+// file or on error.
+bool BgzfReader::ReadFileBlock(string &compressed)
+{
+    unsigned char header[12];
+    size_t n = fread(header, 1, sizeof(header), mFile);
+    if (n == 0 && feof(mFile))
+        return false;
+    if (n != sizeof(header))
+    {
+        mError = true;
+        return false;
+    }
+
+    const size_t extraLength = header[10] | header[11] << 8;
+    compressed.assign((const char *)header, sizeof(header));
+    compressed.resize(sizeof(header) + extraLength);
+    if (fread(&compressed[sizeof(header)], 1, extraLength, mFile) != extraLength)
+    {
+        mError = true;
+        return false;
+    }
+    const size_t blockSize =
+        bgzfBlockSize((const unsigned char *)compressed.data(), compressed.size());
+    if (blockSize == 0)
+    {
+        mError = true;
+        return false;
+    }
+
+    compressed.resize(blockSize);
+    const size_t rest = blockSize - sizeof(header) - extraLength;
+    if (fread(&compressed[sizeof(header) + extraLength], 1, rest, mFile) != rest)
+    {
+        mError = true;
+        return false;
+    }
+    return true;
+}
+
+// Read and inflate one block. Returns false at the end of the file or on error.
+bool BgzfReader::ReadBlock(BgzfDecompressor &decompressor, string &compressed, string &data)
+{
+    const unsigned char *block;
+    size_t blockSize;
+    if (mMap != nullptr)
+    {
+        if (mMapPosition == mMapSize)
+            return false;
+        block = mMap + mMapPosition;
+        blockSize = bgzfBlockSize(block, mMapSize - mMapPosition);
+        if (blockSize == 0 || blockSize > mMapSize - mMapPosition)
+        {
+            mError = true;
+            return false;
+        }
+        mMapPosition += blockSize;
+    }
+    else
+    {
+        if (!ReadFileBlock(compressed))
+            return false;
+        block = (const unsigned char *)compressed.data();
+        blockSize = compressed.size();
+    }
+
+    const size_t headerSize = 12 + (block[10] | block[11] << 8);
+    const unsigned char *footer = block + blockSize - BGZF_FOOTER_SIZE;
+    const uint32_t crc = footer[0] | footer[1] << 8 | footer[2] << 16 | (uint32_t)footer[3] << 24;
+    const uint32_t uncompressedSize =
+        footer[4] | footer[5] << 8 | footer[6] << 16 | (uint32_t)footer[7] << 24;
+    // A corrupt size must not be allocated, nor corrupt data be handed to the records
+    if (uncompressedSize > BGZF_MAX_BLOCK_SIZE)
+    {
+        mError = true;
+        return false;
+    }
+    data.resize(uncompressedSize);
+    if (uncompressedSize == 0)
+        return true;
+
+    if (!decompressor.Inflate(block + headerSize,
+                              blockSize - headerSize - BGZF_FOOTER_SIZE,
+                              &data[0],
+                              uncompressedSize)
+        || blockCrc32(data.data(), uncompressedSize) != crc)
+    {
+        mError = true;
+        return false;
+    }
+    return true;
+}
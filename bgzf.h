@@ -0,0 +1,239 @@
+#ifndef BGZF_H
+#define BGZF_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+// Maximum amount of uncompressed data stored in one BGZF block (same limit as htslib, so that
+// even incompressible data fits into the 64 KB block after deflate).
+const size_t BGZF_BLOCK_DATA_SIZE = 0xff00;
+// Maximum size of a compressed BGZF block, header and footer included.
+const size_t BGZF_MAX_BLOCK_SIZE = 0x10000;
+
+// Highest compression level of the deflate backend: libdeflate goes further than zlib. Level 0
+// stores the data, -1 (Z_DEFAULT_COMPRESSION) is level 6 of either backend.
+#ifdef HAVE_LIBDEFLATE
+const int BGZF_MAX_LEVEL = 12;
+#else
+const int BGZF_MAX_LEVEL = 9;
+#endif
+
+// Number of decompressed blocks a BgzfReader keeps ahead of its consumer
+const size_t BGZF_READ_AHEAD = 64;
+
+class BgzfWriter;
+
+// Deflates BGZF blocks with libdeflate when built with HAVE_LIBDEFLATE, with zlib otherwise.
+// Keeps its compressor between blocks so that the deflate state is only allocated once per
+// thread.
+class BgzfCompressor
+{
+public:
+    BgzfCompressor();
+    ~BgzfCompressor();
+
+    // Compress 'length' bytes of 'data' into a complete BGZF block (header, deflate stream and
+    // footer) stored in 'block'.
+    bool Compress(const char *data, size_t length, int level, std::string &block);
+
+private:
+    bool Deflate(const char *data, size_t length, int level, std::string &block);
+
+#ifdef HAVE_LIBDEFLATE
+    libdeflate_compressor *mCompressor;
+#else
+    z_stream mStream;
+    bool mInitialized;
+#endif
+    int mLevel;
+};
+
+// Inflates BGZF blocks with the same backend as BgzfCompressor
+class BgzfDecompressor
+{
+public:
+    BgzfDecompressor();
+    ~BgzfDecompressor();
+
+    // Inflate the raw deflate stream of a block, which must hold exactly 'length' bytes, into
+    // 'data'
+    bool Inflate(const unsigned char *stream, size_t streamLength, char *data, size_t length);
+
+private:
+#ifdef HAVE_LIBDEFLATE
+    libdeflate_decompressor *mDecompressor;
+#else
+    z_stream mStream;
+    bool mInitialized;
+#endif
+};
+
+// Pool of worker threads deflating full BGZF blocks on behalf of one or several BgzfWriter.
+class BgzfPool
+{
+public:
+    explicit BgzfPool(int numThreads);
+    ~BgzfPool();
+
+    struct Job
+    {
+        BgzfWriter *Writer;
+        uint64_t Index;
+        std::string Data;  // uncompressed block
+        std::string Block; // compressed block, filled by the worker
+    };
+
+    void Submit(Job *job);
+    int Size() const;
+
+private:
+    void Work();
+
+    std::vector<std::thread> mThreads;
+    std::deque<Job *> mJobs;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mStop;
+};
+
+// Writes a BGZF stream. When a BgzfPool is given, full blocks are handed to the pool and written
+// back in the order in which they were filled, so the caller never waits on deflate (unless too
+// many blocks are already in flight). Blocks are compressed independently, therefore the output
+// is identical whatever the number of threads. Every block but the last holds
+// BGZF_BLOCK_DATA_SIZE bytes, so that byte n of the stream is in block n / BGZF_BLOCK_DATA_SIZE,
+// unless Sync() ends blocks early.
+class BgzfWriter
+{
+public:
+    BgzfWriter();
+    ~BgzfWriter();
+
+    // "-" writes to the standard output
+    bool Open(const std::string &filename, int compressionLevel, BgzfPool *pool = nullptr);
+    // Write to the standard input of a shell command, e.g. a converter to another format. Close()
+    // waits for the command and fails if it does.
+    bool OpenCommand(const std::string &command, int compressionLevel, BgzfPool *pool = nullptr);
+    // Continue a file written up to a size returned by Sync(): it is truncated to that size and
+    // the next blocks are appended
+    bool Resume(const std::string &filename,
+                uint64_t size,
+                int compressionLevel,
+                BgzfPool *pool = nullptr);
+    bool Write(const char *data, size_t length);
+    // End the current block (even if it is not full) and write all the blocks to the disk.
+    // fileSize receives the size of the file, which ends with a complete block.
+    bool Sync(uint64_t &fileSize);
+    bool Close();
+    bool IsOpen() const;
+    // Offset in the file of each block written so far, followed by that of the end marker once
+    // the file is closed
+    const std::vector<uint64_t> &BlockOffsets() const;
+
+private:
+    friend class BgzfPool;
+
+    void Start(int compressionLevel, BgzfPool *pool);
+    bool FlushBlock();
+    bool WriteBlock(const std::string &block);
+    void BlockDone(BgzfPool::Job *job);
+
+    FILE *mFile;
+    bool mCommand; // mFile is a pipe to a command
+    int mLevel;
+    BgzfPool *mPool;
+    std::atomic<bool> mError;
+    std::vector<uint64_t> mBlockOffsets;
+    uint64_t mFileSize;
+
+    // Single-threaded path
+    std::string mData;
+    std::string mBlock;
+    BgzfCompressor mCompressor;
+
+    // Multithreaded path
+    BgzfPool::Job *mCurrent;
+    uint64_t mNextIndex;
+    uint64_t mNextWrite;
+    size_t mInFlight;
+    size_t mMaxInFlight;
+    std::map<uint64_t, BgzfPool::Job *> mDone;
+    std::vector<BgzfPool::Job *> mFree;
+    std::vector<BgzfPool::Job *> mJobs;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+};
+
+// Reads a BGZF stream. A background thread reads and inflates the blocks ahead of the consumer
+// into a bounded ring buffer, so that several inputs are inflated in parallel with each other
+// and with the processing of the records. Regular files on local filesystems are mapped in memory
+// and inflated straight from the page cache; pipes and network filesystems are read with stdio.
+class BgzfReader
+{
+public:
+    BgzfReader();
+    ~BgzfReader();
+
+    // "-" reads the standard input
+    bool Open(const std::string &filename, size_t readAhead = BGZF_READ_AHEAD);
+    // Read the standard output of a shell command, e.g. a converter from another format. The
+    // stream cannot seek, and a command failing is an error of the stream once its output ends.
+    bool OpenCommand(const std::string &command, size_t readAhead = BGZF_READ_AHEAD);
+    // Copy the next 'length' bytes of the uncompressed stream into 'data'. Returns the number of
+    // bytes copied, which is less than 'length' only at the end of the stream or on error.
+    size_t Read(char *data, size_t length);
+    // Virtual offset of the next byte of the uncompressed stream: offset of its block in the file
+    // << 16 | offset in the block. UINT64_MAX at the end of the stream.
+    uint64_t Tell();
+    // Go to a virtual offset returned by Tell() (UINT64_MAX: the end of the stream) or found in an
+    // index. The blocks read ahead are dropped and read again from there.
+    bool Seek(uint64_t virtualOffset);
+    bool Close();
+    bool IsOpen() const;
+    bool HasError() const;
+
+private:
+    void Start(size_t readAhead);
+    bool MapFile();
+    bool ReadBlock(BgzfDecompressor &decompressor, std::string &compressed, std::string &data);
+    bool ReadFileBlock(std::string &compressed);
+    bool NextBlock();
+    void StartPrefetch();
+    void StopPrefetch();
+    void Prefetch();
+
+    FILE *mFile;
+    bool mCommand;     // mFile is a pipe from a command
+    bool mCommandDone; // the command has been waited for by mThread
+    std::thread mThread;
+    const unsigned char *mMap; // nullptr: the file is read with mFile
+    size_t mMapSize;
+    size_t mMapPosition; // offset of the next block to read in mMap
+
+    // Ring buffer of decompressed blocks, filled by mThread
+    std::vector<std::string> mBlocks;
+    std::vector<uint64_t> mOffsets; // offset in the file of each block of mBlocks
+    size_t mHead;     // block being read by the consumer
+    size_t mCount;    // number of blocks available to the consumer
+    size_t mPosition; // position of the consumer in mBlocks[mHead]
+    bool mAvailable;  // mBlocks[mHead] is being read by the consumer
+    bool mEof;        // no more blocks will be added
+    bool mStop;
+    std::atomic<bool> mError;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+};
+
+#endif
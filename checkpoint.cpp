@@ -0,0 +1,160 @@
+#include "checkpoint.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+#include "manifest.h"
+
+using namespace std;
+
+// First line of a checkpoint file, with the version of its format
+static const char CHECKPOINT_MAGIC[] = "bam-mergeRef checkpoint 1";
+
+Checkpoint::Checkpoint() : Seed(0), OutputSize(0), TrashSize(0), ManifestSize(0)
+{
+}
+
+// Lines of a key and its values, separated by tabs
+bool Checkpoint::Write(const string &filename) const
+{
+    ostringstream out;
+    out << CHECKPOINT_MAGIC << "\n";
+    out << "seed\t" << Seed << "\n";
+    out << "last_name\t" << LastName << "\n";
+    for (size_t k = 0; k < InputNames.size(); k++)
+        out << "input\t" << InputOffsets[k] << "\t" << InputNames[k] << "\n";
+    out << "output\t" << OutputSize << "\n";
+    out << "trash\t" << TrashSize << "\n";
+    out << "manifest\t" << ManifestSize << "\n";
+    for (size_t k = 0; k < Stats.RecordsRead.size(); k++)
+        out << "records_read\t" << k << "\t" << Stats.RecordsRead[k] << "\n";
+    for (size_t mask = 0; mask < Stats.Kept.size(); mask++)
+        out << "kept\t" << mask << "\t" << Stats.Kept[mask] << "\n";
+    for (int i = 0; i < NUM_TRASH_REASONS; i++)
+        out << "trashed\t" << i << "\t" << Stats.Trashed[i] << "\n";
+    out << "dropped_unmapped\t" << Stats.DroppedUnmapped << "\n";
+    const string text = out.str();
+
+    const string temporary = filename + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "w");
+    if (file == nullptr)
+        return false;
+    bool ok = fwrite(text.data(), 1, text.size(), file) == text.size() && fflush(file) == 0
+              && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    return ok && rename(temporary.c_str(), filename.c_str()) == 0;
+}
+
+bool Checkpoint::Read(const string &filename)
+{
+    ifstream in(filename);
+    string line;
+    if (!getline(in, line) || line != CHECKPOINT_MAGIC)
+    {
+        cerr << "Error: Could not read checkpoint " << filename << "." << endl;
+        return false;
+    }
+
+    InputNames.clear();
+    InputOffsets.clear();
+    vector<uint64_t> recordsRead;
+    vector<uint64_t> kept;
+    bool ok = true;
+    while (ok && getline(in, line))
+    {
+        istringstream fields(line);
+        string key;
+        getline(fields, key, '\t');
+        size_t index;
+        uint64_t value;
+        if (key == "seed")
+            ok = (bool)(fields >> Seed);
+        else if (key == "last_name")
+            getline(fields, LastName);
+        else if (key == "input")
+        {
+            string name;
+            ok = fields >> value && fields.get() == '\t' && getline(fields, name);
+            InputOffsets.push_back(value);
+            InputNames.push_back(name);
+        }
+        else if (key == "output")
+            ok = (bool)(fields >> OutputSize);
+        else if (key == "trash")
+            ok = (bool)(fields >> TrashSize);
+        else if (key == "manifest")
+            ok = (bool)(fields >> ManifestSize);
+        else if (key == "records_read" || key == "kept")
+        {
+            vector<uint64_t> &counters = key == "kept" ? kept : recordsRead;
+            ok = fields >> index >> value && index == counters.size();
+            counters.push_back(value);
+        }
+        else if (key == "trashed")
+        {
+            ok = fields >> index >> value && index < NUM_TRASH_REASONS;
+            if (ok)
+                Stats.Trashed[index] = value;
+        }
+        else if (key == "dropped_unmapped")
+            ok = (bool)(fields >> Stats.DroppedUnmapped);
+        else
+            ok = false;
+    }
+    if (!ok || in.bad() || InputNames.empty() || recordsRead.size() != InputNames.size()
+        || kept.size() != (size_t)1 << InputNames.size())
+    {
+        cerr << "Error: Could not read checkpoint " << filename << "." << endl;
+        return false;
+    }
+    Stats.RecordsRead = recordsRead;
+    Stats.Kept = kept;
+    return true;
+}
+
+
+Checkpointer::Checkpointer(const string &filename, int interval, const Checkpoint &start) :
+    mFilename(filename),
+    mInterval(chrono::duration_cast<Clock::duration>(chrono::seconds(interval))),
+    mLast(Clock::now()),
+    mCheckpoint(start)
+{
+}
+
+bool Checkpointer::Due() const
+{
+    return mInterval.count() > 0 && Clock::now() - mLast >= mInterval;
+}
+
+const string &Checkpointer::LastName() const
+{
+    return mCheckpoint.LastName;
+}
+
+bool Checkpointer::Save(const vector<uint64_t> &inputOffsets,
+                        const string &lastName,
+                        MergeOutput &output)
+{
+    mLast = Clock::now();
+    mCheckpoint.InputOffsets = inputOffsets;
+    mCheckpoint.LastName = lastName;
+    if (!output.OutFile->Sync(mCheckpoint.OutputSize)
+        || (output.TrashFile != nullptr && !output.TrashFile->Sync(mCheckpoint.TrashSize))
+        || (output.Manifest != nullptr && !output.Manifest->Sync(mCheckpoint.ManifestSize)))
+    {
+        cerr << "Error: Could not write the output files for checkpoint " << mFilename << "."
+             << endl;
+        return false;
+    }
+    if (output.Stats != nullptr)
+        mCheckpoint.Stats = *output.Stats;
+    if (!mCheckpoint.Write(mFilename))
+    {
+        cerr << "Error: Could not write checkpoint " << mFilename << "." << endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "merge.h"
+#include "stats.h"
+
+// State of a merge of files sorted by names: the names up to LastName have been merged and their
+// records written, none of the names after it
+struct Checkpoint
+{
+    Checkpoint();
+
+    // Write to filename, through a temporary file renamed once it is on the disk, so that a merge
+    // killed at any time leaves the previous checkpoint or this one
+    bool Write(const std::string &filename) const;
+    // Returns false (after printing an error message) if filename is not a checkpoint
+    bool Read(const std::string &filename);
+
+    uint64_t Seed; // of the choice between identical alignments
+    std::string LastName;
+    std::vector<std::string> InputNames;
+    std::vector<uint64_t> InputOffsets; // virtual offset of the next record, UINT64_MAX at the end
+    uint64_t OutputSize;                // of the output file, which ends with a BGZF block there
+    uint64_t TrashSize;                 // same for the trash file, 0 without one
+    uint64_t ManifestSize;              // of the discard manifest, 0 without one
+    MergeStats Stats;                   // counters of the merge so far (not the times)
+};
+
+// Saves the state of a merge every interval seconds (never if interval is 0), starting from a
+// checkpoint: a new one, or the one a resumed merge starts from
+class Checkpointer
+{
+public:
+    Checkpointer(const std::string &filename, int interval, const Checkpoint &start);
+
+    bool Due() const;
+    // Name after which the merge starts, empty for a new merge
+    const std::string &LastName() const;
+    // Write the records saved so far to the disk, then the checkpoint. Returns false (after
+    // printing an error message) on error.
+    bool Save(const std::vector<uint64_t> &inputOffsets,
+              const std::string &lastName,
+              MergeOutput &output);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    const std::string mFilename;
+    const Clock::duration mInterval;
+    Clock::time_point mLast; // time of the last checkpoint
+    Checkpoint mCheckpoint;
+};
+
+#endif
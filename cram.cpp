@@ -0,0 +1,56 @@
+#include "cram.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+// Single-quoted argument of a shell command
+static string shellQuote(const string &argument)
+{
+    string quoted = "'";
+    for (char c : argument)
+    {
+        if (c == '\'')
+            quoted += "'\\''";
+        else
+            quoted += c;
+    }
+    return quoted + "'";
+}
+
+bool isCramFile(const string &filename)
+{
+    if (filename == "-")
+        return false;
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (file == nullptr)
+        return false;
+    char magic[4];
+    const bool cram = fread(magic, 1, 4, file) == 4 && memcmp(magic, "CRAM", 4) == 0;
+    fclose(file);
+    return cram;
+}
+
+bool hasCramExtension(const string &filename)
+{
+    return filename.size() > 5 && filename.compare(filename.size() - 5, 5, ".cram") == 0;
+}
+
+string cramReadCommand(const string &filename, const string &reference)
+{
+    string command = "samtools view -u";
+    if (!reference.empty())
+        command += " -T " + shellQuote(reference);
+    return command + " " + shellQuote(filename);
+}
+
+string cramWriteCommand(const string &filename, const string &reference, bool index)
+{
+    string command = "samtools view -C";
+    if (!reference.empty())
+        command += " -T " + shellQuote(reference);
+    if (index)
+        command += " --write-index";
+    return command + " -o " + shellQuote(filename) + " -";
+}
@@ -0,0 +1,24 @@
+#ifndef CRAM_H
+#define CRAM_H
+
+#include <string>
+
+// CRAM files are read and written through samtools, which converts them from and to the BAM
+// streams of BamInput and BamOutput on a pipe, so that no BAM copy is stored on disk.
+
+// File starting with the CRAM magic number ("-" is never one, the standard input is not peeked)
+bool isCramFile(const std::string &filename);
+// Name of a file to be written as CRAM
+bool hasCramExtension(const std::string &filename);
+
+// Command writing the records of a CRAM file as uncompressed BAM on its standard output.
+// reference is the FASTA file the CRAM file was encoded against, or empty to let samtools find it
+// (UR and M5 tags of the @SQ lines, REF_PATH).
+std::string cramReadCommand(const std::string &filename, const std::string &reference);
+// Command encoding the BAM stream of its standard input into a CRAM file against a FASTA file.
+// With index, the records must be sorted by coordinates and a .crai index is written as well.
+std::string cramWriteCommand(const std::string &filename,
+                             const std::string &reference,
+                             bool index);
+
+#endif
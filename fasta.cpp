@@ -0,0 +1,136 @@
+#include "fasta.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Bases read at once from a sequence, from a multiple of this size
+static const int64_t FASTA_WINDOW = 1 << 14;
+
+FastaFile::FastaFile() : mData(nullptr), mSize(0)
+{
+}
+
+FastaFile::~FastaFile()
+{
+    Close();
+}
+
+bool FastaFile::Open(const string &filename)
+{
+    Close();
+    if (!ReadIndex(filename + ".fai"))
+    {
+        cerr << "Error: Could not read FASTA index " << filename << ".fai." << endl;
+        return false;
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            mData = (const char *)data;
+            mSize = st.st_size;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    if (mData == nullptr)
+    {
+        cerr << "Error: Could not read FASTA file " << filename << "." << endl;
+        return false;
+    }
+    return true;
+}
+
+void FastaFile::Close()
+{
+    if (mData != nullptr)
+        munmap((void *)mData, mSize);
+    mData = nullptr;
+    mSize = 0;
+    mSequences.clear();
+    mNames.clear();
+}
+
+// Lines of name, length, offset, bases per line and bytes per line
+bool FastaFile::ReadIndex(const string &filename)
+{
+    ifstream in(filename);
+    if (!in)
+        return false;
+    string line;
+    while (getline(in, line))
+    {
+        if (line.empty())
+            continue;
+        const size_t tab = line.find('\t');
+        if (tab == string::npos)
+            return false;
+        istringstream fields(line.substr(tab + 1));
+        Sequence sequence;
+        if (!(fields >> sequence.Length >> sequence.Offset >> sequence.LineBases
+              >> sequence.LineWidth)
+            || sequence.Length < 0 || sequence.LineBases <= 0
+            || sequence.LineWidth < sequence.LineBases)
+            return false;
+        sequence.WindowBegin = 0;
+        mNames.emplace(line.substr(0, tab), mSequences.size());
+        mSequences.push_back(sequence);
+    }
+    return !in.bad();
+}
+
+int FastaFile::FindSequence(const string &name) const
+{
+    auto it = mNames.find(name);
+    return it == mNames.end() ? -1 : it->second;
+}
+
+int64_t FastaFile::SequenceLength(int sequence) const
+{
+    return mSequences[sequence].Length;
+}
+
+const char *FastaFile::Fetch(int sequence, int64_t begin, int64_t end)
+{
+    Sequence &seq = mSequences[sequence];
+    if (begin < 0 || end > seq.Length || begin > end)
+        return nullptr;
+    if (begin >= seq.WindowBegin && end <= seq.WindowBegin + (int64_t)seq.Window.size())
+        return seq.Window.data() + (begin - seq.WindowBegin);
+
+    // Whole windows around the bases, copied line by line
+    const int64_t windowBegin = begin / FASTA_WINDOW * FASTA_WINDOW;
+    const int64_t windowEnd = min(
+        seq.Length, (max(end, windowBegin + 1) + FASTA_WINDOW - 1) / FASTA_WINDOW * FASTA_WINDOW);
+    seq.Window.clear();
+    seq.WindowBegin = windowBegin;
+    for (int64_t pos = windowBegin; pos < windowEnd;)
+    {
+        const int64_t column = pos % seq.LineBases;
+        const int64_t length = min(seq.LineBases - column, windowEnd - pos);
+        const uint64_t offset = seq.Offset + pos / seq.LineBases * seq.LineWidth + column;
+        if (offset + length > mSize)
+        {
+            seq.Window.clear();
+            return nullptr;
+        }
+        seq.Window.append(mData + offset, length);
+        pos += length;
+    }
+    for (char &base : seq.Window)
+        base = toupper((unsigned char)base);
+    return seq.Window.data() + (begin - seq.WindowBegin);
+}
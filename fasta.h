@@ -0,0 +1,48 @@
+#ifndef FASTA_H
+#define FASTA_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// FASTA file indexed by samtools faidx (filename.fai), mapped in memory. The bases of each
+// sequence are read through a window of the sequence, without line breaks and in upper case,
+// that is kept until a base outside of it is needed.
+class FastaFile
+{
+public:
+    FastaFile();
+    ~FastaFile();
+
+    // Returns false (after printing an error message) if the file or its index cannot be read
+    bool Open(const std::string &filename);
+    void Close();
+    // Number of a sequence in the index, -1 if there is none with this name
+    int FindSequence(const std::string &name) const;
+    int64_t SequenceLength(int sequence) const;
+    // Bases [begin, end) of a sequence, or nullptr if they are not all within the sequence. The
+    // pointer is valid until the next call.
+    const char *Fetch(int sequence, int64_t begin, int64_t end);
+
+private:
+    // Line of the .fai index, and the bases of the sequence last fetched
+    struct Sequence
+    {
+        int64_t Length;
+        uint64_t Offset; // of the first base in the file
+        int64_t LineBases;
+        int64_t LineWidth; // bases and line break
+        int64_t WindowBegin;
+        std::string Window;
+    };
+
+    bool ReadIndex(const std::string &filename);
+
+    const char *mData;
+    size_t mSize;
+    std::vector<Sequence> mSequences;
+    std::unordered_map<std::string, int> mNames;
+};
+
+#endif
@@ -0,0 +1,390 @@
+#include "hashjoin.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+static const size_t ARENA_CHUNK_SIZE = 16 << 20;
+static const int NUM_SHARDS = 16;
+// Past this depth the shards are merged in memory whatever their size, since names hashing to
+// the same shard over and over cannot be split further
+static const int MAX_DEPTH = 4;
+// Estimated memory used by the hash tables for each name, on top of the records
+static const size_t ENTRY_OVERHEAD = 64;
+
+struct NameHash
+{
+    size_t operator()(const char *name) const
+    {
+        return hashReadName(name);
+    }
+};
+
+struct NameEqual
+{
+    bool operator()(const char *a, const char *b) const
+    {
+        return strcmp(a, b) == 0;
+    }
+};
+
+// Records held in memory, stored back to back in large chunks ([length][raw record]) and indexed
+// by read name
+class RecordTable
+{
+public:
+    struct Entry
+    {
+        const char *Records[2];
+        int Count;
+    };
+    typedef unordered_map<const char *, Entry, NameHash, NameEqual> Map;
+
+    RecordTable() : mUsed(0), mChunkSize(0), mChunkBytes(0)
+    {
+    }
+
+    ~RecordTable()
+    {
+        Clear();
+    }
+
+    // Returns false if the name already has two records
+    bool Add(const BamRecord &rec)
+    {
+        const char *stored = Store(rec.RawData());
+        Entry &entry = mEntries[stored + sizeof(uint32_t) + 32]; // key: name in the stored record
+        if (entry.Count == 2)
+            return false;
+        entry.Records[entry.Count++] = stored;
+        return true;
+    }
+
+    static bool Load(const char *stored, BamRecord &rec)
+    {
+        uint32_t length;
+        memcpy(&length, stored, sizeof(length));
+        return rec.SetRawData(stored + sizeof(length), length);
+    }
+
+    size_t MemoryUsage() const
+    {
+        return mChunkBytes + mEntries.size() * ENTRY_OVERHEAD
+               + mEntries.bucket_count() * sizeof(void *);
+    }
+
+    Map &Entries()
+    {
+        return mEntries;
+    }
+
+    void Clear()
+    {
+        mEntries.clear();
+        for (auto chunk : mChunks)
+            delete[] chunk;
+        mChunks.clear();
+        mUsed = mChunkSize = mChunkBytes = 0;
+    }
+
+private:
+    const char *Store(const string &raw)
+    {
+        uint32_t length = raw.size();
+        size_t size = sizeof(length) + length;
+        if (mUsed + size > mChunkSize)
+        {
+            mChunkSize = max(ARENA_CHUNK_SIZE, size);
+            mChunks.push_back(new char[mChunkSize]);
+            mChunkBytes += mChunkSize;
+            mUsed = 0;
+        }
+        char *stored = mChunks.back() + mUsed;
+        memcpy(stored, &length, sizeof(length));
+        memcpy(stored + sizeof(length), raw.data(), length);
+        mUsed += size;
+        return stored;
+    }
+
+    vector<char *> mChunks;
+    size_t mUsed;      // bytes used in the last chunk
+    size_t mChunkSize; // size of the last chunk
+    size_t mChunkBytes;
+    Map mEntries;
+};
+
+class HashJoin
+{
+public:
+    HashJoin(BamInput &file1,
+             BamInput &file2,
+             MergeOutput &output,
+             const HashJoinOptions &options,
+             int depth) :
+        mOutput(output),
+        mOptions(options),
+        mDepth(depth),
+        mBuild(options.BuildOnFile1 ? 0 : 1),
+        mProbe(options.BuildOnFile1 ? 1 : 0),
+        mPendingBytes(0)
+    {
+        mFiles[0] = &file1;
+        mFiles[1] = &file2;
+        mBuildGroup[0] = &mBuildRecords[0];
+        mBuildGroup[1] = &mBuildRecords[1];
+    }
+
+    bool Run();
+
+private:
+    bool Limited() const;
+    bool MergeGroup(BamRecord *group[], int n);
+    bool MergeLeftovers();
+    bool Spill();
+    bool ReadError(int side) const;
+
+    BamInput *mFiles[2];
+    MergeOutput &mOutput;
+    const HashJoinOptions &mOptions;
+    const int mDepth;
+    const int mBuild; // index of the file held in memory
+    const int mProbe; // index of the file streamed against it
+
+    RecordTable mTable;
+    // First mates of the streamed file waiting for their mate
+    unordered_map<string, BamRecord> mPending;
+    size_t mPendingBytes;
+
+    BamRecord mBuildRecords[2];
+    BamRecord *mBuildGroup[2];
+};
+
+bool HashJoin::Limited() const
+{
+    return mDepth < MAX_DEPTH
+           && mTable.MemoryUsage() + mPendingBytes > mOptions.MemoryLimit;
+}
+
+bool HashJoin::ReadError(int side) const
+{
+    cerr << "Error: Could not read inputfile " << side + 1 << "." << endl;
+    return false;
+}
+
+bool HashJoin::Run()
+{
+    BamRecord rec;
+    while (mFiles[mBuild]->GetNextAlignmentCore(rec))
+    {
+        if (!mTable.Add(rec))
+        {
+            cerr << "Error: More than two records are named " << rec.Name() << " in inputfile "
+                 << mBuild + 1 << "." << endl;
+            return false;
+        }
+        if (Limited())
+            return Spill();
+    }
+    if (mFiles[mBuild]->HasError())
+        return ReadError(mBuild);
+
+    while (mFiles[mProbe]->GetNextAlignmentCore(rec))
+    {
+        if (!rec.IsPaired())
+        {
+            BamRecord *group[1] = {&rec};
+            if (!MergeGroup(group, 1))
+                return false;
+            continue;
+        }
+
+        auto it = mPending.find(rec.Name());
+        if (it == mPending.end())
+        {
+            mPending.emplace(rec.Name(), rec);
+            mPendingBytes += sizeof(BamRecord) + rec.RawData().capacity() + ENTRY_OVERHEAD;
+            if (Limited())
+                return Spill();
+            continue;
+        }
+
+        BamRecord *group[2] = {&it->second, &rec};
+        if (!MergeGroup(group, 2))
+            return false;
+        mPendingBytes -= sizeof(BamRecord) + it->second.RawData().capacity() + ENTRY_OVERHEAD;
+        mPending.erase(it);
+    }
+    if (mFiles[mProbe]->HasError())
+        return ReadError(mProbe);
+
+    return MergeLeftovers();
+}
+
+// Merge the records of one name of the streamed file with those of the file held in memory
+bool HashJoin::MergeGroup(BamRecord *group[], int n)
+{
+    int m = 0;
+    auto it = mTable.Entries().find(group[0]->Name());
+    if (it != mTable.Entries().end())
+    {
+        m = it->second.Count;
+        for (int i = 0; i < m; i++)
+            RecordTable::Load(it->second.Records[i], mBuildRecords[i]);
+        mTable.Entries().erase(it);
+    }
+    else if (n == 1 && group[0]->IsPaired())
+    {
+        cerr << "Error: A widow was encountered in file " << mProbe + 1
+             << ". Check that all paired reads have a mate" << endl;
+        return false;
+    }
+
+    if (mBuild == 0)
+        mergeRecords(mBuildGroup, m, group, n, mOutput);
+    else
+        mergeRecords(group, n, mBuildGroup, m, mOutput);
+    return true;
+}
+
+// Widows of the streamed file, then names that are only in the file held in memory
+bool HashJoin::MergeLeftovers()
+{
+    for (auto &pending : mPending)
+    {
+        BamRecord *group[1] = {&pending.second};
+        if (!MergeGroup(group, 1))
+            return false;
+    }
+    mPending.clear();
+
+    for (auto &entry : mTable.Entries())
+    {
+        int m = entry.second.Count;
+        for (int i = 0; i < m; i++)
+            RecordTable::Load(entry.second.Records[i], mBuildRecords[i]);
+        if (m == 1 && mBuildRecords[0].IsPaired())
+        {
+            cerr << "Error: A widow was encountered in file " << mBuild + 1
+                 << ". Check that all paired reads have a mate" << endl;
+            return false;
+        }
+        if (mBuild == 0)
+            mergeRecords(mBuildGroup, m, nullptr, 0, mOutput);
+        else
+            mergeRecords(nullptr, 0, mBuildGroup, m, mOutput);
+    }
+    mTable.Clear();
+    return true;
+}
+
+// Partition everything that remains to be merged into shards by name hash, then merge the shards
+// one pair at a time
+bool HashJoin::Spill()
+{
+    vector<string> names[2];
+    vector<BamOutput *> shards[2];
+    bool ok = true;
+    for (int side = 0; side < 2; side++)
+    {
+        for (int k = 0; k < NUM_SHARDS; k++)
+        {
+            names[side].push_back(mOptions.TempPrefix + ".shard" + to_string(mDepth) + "."
+                                  + to_string(k) + "." + to_string(side + 1) + ".bam");
+            shards[side].push_back(new BamOutput);
+            if (ok
+                && !shards[side][k]->Open(names[side][k],
+                                          mOptions.HeaderText,
+                                          mOptions.References,
+                                          1,
+                                          mOptions.Pool))
+            {
+                cerr << "Error: Could not write temporary file " << names[side][k] << "." << endl;
+                ok = false;
+            }
+        }
+    }
+
+    // The salt changes the partitioning between depths
+    const uint64_t salt = mDepth + 1;
+    BamRecord rec;
+    if (ok)
+    {
+        // Records held in memory
+        for (auto &entry : mTable.Entries())
+        {
+            BamOutput *shard = shards[mBuild][hashReadName(entry.first, salt) % NUM_SHARDS];
+            for (int i = 0; i < entry.second.Count; i++)
+            {
+                RecordTable::Load(entry.second.Records[i], rec);
+                shard->SaveAlignment(rec);
+            }
+        }
+        mTable.Clear();
+        for (auto &pending : mPending)
+        {
+            uint64_t k = hashReadName(pending.first.c_str(), salt) % NUM_SHARDS;
+            shards[mProbe][k]->SaveAlignment(pending.second);
+        }
+        mPending.clear();
+        mPendingBytes = 0;
+
+        // Rest of both files
+        for (int side = 0; side < 2; side++)
+        {
+            while (mFiles[side]->GetNextAlignmentCore(rec))
+                shards[side][hashReadName(rec.Name(), salt) % NUM_SHARDS]->SaveAlignment(rec);
+            if (mFiles[side]->HasError())
+                ok = ReadError(side);
+        }
+    }
+
+    for (int side = 0; side < 2; side++)
+    {
+        for (int k = 0; k < NUM_SHARDS; k++)
+        {
+            if (!shards[side][k]->Close() && ok)
+            {
+                cerr << "Error: Could not write temporary file " << names[side][k] << "." << endl;
+                ok = false;
+            }
+            delete shards[side][k];
+        }
+    }
+
+    for (int k = 0; k < NUM_SHARDS && ok; k++)
+    {
+        BamInput shard1;
+        BamInput shard2;
+        if (!shard1.Open(names[0][k]) || !shard2.Open(names[1][k]))
+        {
+            cerr << "Error: Could not read temporary file " << names[0][k] << "." << endl;
+            ok = false;
+            break;
+        }
+        ok = hashJoinMerge(shard1, shard2, mOutput, mOptions, mDepth + 1);
+        shard1.Close();
+        shard2.Close();
+        remove(names[0][k].c_str());
+        remove(names[1][k].c_str());
+    }
+
+    for (int side = 0; side < 2; side++)
+        for (auto &name : names[side])
+            remove(name.c_str());
+    return ok;
+}
+
+
+bool hashJoinMerge(BamInput &file1,
+                   BamInput &file2,
+                   MergeOutput &output,
+                   const HashJoinOptions &options,
+                   int depth)
+{
+    HashJoin join(file1, file2, output, options, depth);
+    return join.Run();
+}
@@ -0,0 +1,32 @@
+#ifndef HASHJOIN_H
+#define HASHJOIN_H
+
+#include <string>
+
+#include "bamio.h"
+#include "merge.h"
+
+struct HashJoinOptions
+{
+    size_t MemoryLimit;     // bytes available for the in-memory tables
+    bool BuildOnFile1;      // hold file 1 in memory (normally the smaller file) instead of file 2
+    std::string TempPrefix; // prefix of the temporary shard files
+    // Header of the shard files: that of the output, since the records carry its RefIDs
+    std::string HeaderText;
+    BamTools::RefVector References;
+    BgzfPool *Pool; // compression workers for the shard files, may be nullptr
+};
+
+// Merge two BAM files in any order (e.g. sorted by coordinates) with the same rules as
+// mergeSortedFiles(). The records of one file are loaded in a table indexed by read name and the
+// other file is streamed against it. When the tables outgrow the memory limit, what remains of
+// both files is partitioned into temporary shards by name hash and the shards are merged one
+// pair at a time. The output follows the order in which names are matched. Returns false (after
+// printing an error message) on error.
+bool hashJoinMerge(BamInput &file1,
+                   BamInput &file2,
+                   MergeOutput &output,
+                   const HashJoinOptions &options,
+                   int depth = 0);
+
+#endif
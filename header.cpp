@@ -0,0 +1,583 @@
+#include "header.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+using namespace BamTools;
+
+
+// First character of the names held by the SN, AN, ID and PP tags
+static bool isNameStart(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+// Characters allowed after the first one
+static bool isNameChar(char c)
+{
+    return isNameStart(c) || c == '*' || c == '+' || c == '.' || c == '@' || c == '_' || c == '|'
+           || c == '-';
+}
+
+// Find the first field <tab><tag>:<name> of a header line whose name starts with a letter or a
+// digit. start is set to the tab, value and end to the bounds of the name.
+static bool findTag(const char *line,
+                    size_t size,
+                    const char *tag,
+                    size_t &start,
+                    size_t &value,
+                    size_t &end)
+{
+    for (size_t i = 0; i + 4 < size; i++)
+    {
+        if (line[i] != '\t' || line[i + 1] != tag[0] || line[i + 2] != tag[1] || line[i + 3] != ':'
+            || !isNameStart(line[i + 4]))
+            continue;
+        start = i;
+        value = i + 4;
+        end = value + 1;
+        while (end < size && isNameChar(line[end]))
+            end++;
+        return true;
+    }
+    return false;
+}
+
+static bool findTag(const string &line, const char *tag, size_t &start, size_t &value, size_t &end)
+{
+    return findTag(line.data(), line.size(), tag, start, value, end);
+}
+
+// Name held by a tag of a header line, empty if it has none
+static string tagValue(const string &line, const char *tag)
+{
+    size_t start, value, end;
+    if (!findTag(line, tag, start, value, end))
+        return string();
+    return line.substr(value, end - value);
+}
+
+// Order of two @SQ lines given by strverscmp(), without copying them to NUL-terminated strings
+// in the usual cases: the bytes are compared directly up to the first difference, and numbers
+// without leading zeros by their number of digits. Other numbers go through strverscmp().
+static int compareSQ(const HeaderLine &a, const HeaderLine &b, string &copyA, string &copyB)
+{
+    const size_t size = min(a.Size, b.Size);
+    size_t i = 0;
+    while (i < size && a.Data[i] == b.Data[i])
+        i++;
+    if (i == a.Size && i == b.Size)
+        return 0;
+    const unsigned char ca = i < a.Size ? a.Data[i] : '\0';
+    const unsigned char cb = i < b.Size ? b.Data[i] : '\0';
+
+    // Digits common to both lines before the difference
+    size_t run = i;
+    while (run > 0 && isdigit((unsigned char)a.Data[run - 1]))
+        run--;
+    const bool digitA = isdigit(ca);
+    const bool digitB = isdigit(cb);
+    if (run == i)
+    {
+        // Numbers that start at the difference compare by length if neither starts with 0
+        if (!digitA || !digitB || ca == '0' || cb == '0')
+            return ca - cb;
+    }
+    else if (a.Data[run] == '0')
+    {
+        copyA.assign(a.Data, a.Size);
+        copyB.assign(b.Data, b.Size);
+        return strverscmp(copyA.c_str(), copyB.c_str());
+    }
+    else if (!digitA || !digitB)
+    {
+        // Within a number the longer one is greater
+        if (digitA == digitB)
+            return ca - cb;
+        return digitA ? 1 : -1;
+    }
+
+    // Both numbers go on at the difference: the one with more digits is greater
+    size_t endA = i + 1;
+    size_t endB = i + 1;
+    while (endA < a.Size && isdigit((unsigned char)a.Data[endA]))
+        endA++;
+    while (endB < b.Size && isdigit((unsigned char)b.Data[endB]))
+        endB++;
+    if (endA - i != endB - i)
+        return endA - i > endB - i ? 1 : -1;
+    return ca - cb;
+}
+
+// Whether the @SQ lines are in strictly increasing strverscmp() order
+static bool isSortedSQ(const vector<HeaderLine> &lines)
+{
+    string copyA, copyB;
+    for (size_t k = 1; k < lines.size(); k++)
+        if (compareSQ(lines[k - 1], lines[k], copyA, copyB) >= 0)
+            return false;
+    return true;
+}
+
+// Hash table of the @SQ lines of a dictionary, to find the lines of the other dictionary that
+// are not at the same place in both. It is only filled on the first lookup.
+class LineIndex
+{
+public:
+    explicit LineIndex(const vector<HeaderLine> &lines) : mLines(lines), mMask(0)
+    {
+    }
+
+    // Index of the first line identical to line, or -1
+    long Find(const HeaderLine &line)
+    {
+        if (mSlots.empty())
+            Fill();
+        const uint64_t hash = hashLine(line);
+        for (size_t slot = hash & mMask; mSlots[slot].Line != 0; slot = (slot + 1) & mMask)
+        {
+            if (mSlots[slot].Hash != (uint32_t)(hash >> 32))
+                continue;
+            const HeaderLine &other = mLines[mSlots[slot].Line - 1];
+            if (other.Size == line.Size && memcmp(other.Data, line.Data, line.Size) == 0)
+                return mSlots[slot].Line - 1;
+        }
+        return -1;
+    }
+
+private:
+    struct Slot
+    {
+        uint32_t Line; // index of the line + 1, 0 for a free slot
+        uint32_t Hash; // high bits of the hash of the line
+    };
+
+    static uint64_t hashLine(const HeaderLine &line)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+        for (size_t i = 0; i < line.Size; i++)
+            hash = (hash ^ (unsigned char)line.Data[i]) * 0x100000001b3ULL;
+        return hash ^ (hash >> 29);
+    }
+
+    void Fill()
+    {
+        // At most half full. Identical lines are all inserted, the first one is found first.
+        size_t size = 16;
+        while (size < 2 * mLines.size())
+            size *= 2;
+        mSlots.assign(size, Slot{0, 0});
+        mMask = size - 1;
+        for (size_t k = 0; k < mLines.size(); k++)
+        {
+            const uint64_t hash = hashLine(mLines[k]);
+            size_t slot = hash & mMask;
+            while (mSlots[slot].Line != 0)
+                slot = (slot + 1) & mMask;
+            mSlots[slot] = Slot{(uint32_t)(k + 1), (uint32_t)(hash >> 32)};
+        }
+    }
+
+    const vector<HeaderLine> &mLines;
+    vector<Slot> mSlots;
+    size_t mMask;
+};
+
+// Append an @SQ line to out, adding the alternative names of its sequence in the input files
+// of mask (bit k for file k + 1) to its AN tag, e.g. AN:chr1-hg19-1,chr1-hg38-2. The suffixes
+// are the parts of the alternative names that follow the sequence name, e.g. -hg19-1.
+static bool appendSQ(string &out,
+                     const HeaderLine &sq,
+                     unsigned mask,
+                     const vector<string> &suffixes)
+{
+    const char *line = sq.Data;
+    const size_t size = sq.Size;
+    size_t start, value, end;
+    if (!findTag(line, size, "SN", start, value, end))
+    {
+        cerr << "Error: A header line (@SQ) is missing its SN tag in ";
+        if (mask == 3 && suffixes.size() == 2)
+            cerr << "both input files.";
+        else if ((mask & (mask - 1)) == 0)
+            cerr << "input file " << __builtin_ctz(mask) + 1 << ".";
+        else
+        {
+            cerr << "input files";
+            for (size_t k = 0; k < suffixes.size(); k++)
+                if (mask & (1u << k))
+                    cerr << (mask & ((1u << k) - 1) ? ", " : " ") << k + 1;
+            cerr << ".";
+        }
+        cerr << endl;
+        return false;
+    }
+    const char *name = line + value;
+    const size_t nameSize = end - value;
+
+    // The names are added after the existing ones, or in a new AN tag at the end of the line
+    size_t anStart, anValue, anEnd = size;
+    const bool hasAN = findTag(line, size, "AN", anStart, anValue, anEnd);
+    if (hasAN)
+    {
+        while (anEnd + 1 < size && line[anEnd] == ',' && isNameStart(line[anEnd + 1]))
+        {
+            anEnd += 2;
+            while (anEnd < size && isNameChar(line[anEnd]))
+                anEnd++;
+        }
+    }
+    // The line is built in place, this runs once per sequence of all the dictionaries
+    const char *tag = hasAN ? "," : "\tAN:";
+    const size_t tagSize = hasAN ? 1 : 4;
+    size_t added = tagSize;
+    for (size_t k = 0; k < suffixes.size(); k++)
+        if (mask & (1u << k))
+            added += nameSize + suffixes[k].size() + 1; // and a comma or the newline
+    size_t pos = out.size();
+    out.resize(pos + size + added);
+    char *p = &out[pos];
+    p = (char *)memcpy(p, line, anEnd) + anEnd;
+    p = (char *)memcpy(p, tag, tagSize) + tagSize;
+    bool firstName = true;
+    for (size_t k = 0; k < suffixes.size(); k++)
+    {
+        if (!(mask & (1u << k)))
+            continue;
+        if (!firstName)
+            *p++ = ',';
+        firstName = false;
+        p = (char *)memcpy(p, name, nameSize) + nameSize;
+        p = (char *)memcpy(p, suffixes[k].data(), suffixes[k].size()) + suffixes[k].size();
+    }
+    p = (char *)memcpy(p, line + anEnd, size - anEnd) + (size - anEnd);
+    *p = '\n';
+    return true;
+}
+
+// Make the IDs of the @PG lines that are also found in otherLines unique with a random suffix, and
+// point the PP tag of the line that follows each of them (the next program run) to the new ID.
+// previousRun is set if a line of this program is found.
+static void renamePG(vector<string> &lines,
+                     const vector<string> &otherLines,
+                     const string &programID,
+                     mt19937_64 &generator,
+                     bool &previousRun)
+{
+    vector<string> otherIDs;
+    for (auto &str : otherLines)
+        otherIDs.push_back(tagValue(str, "ID")); // ID SHOULD ALWAYS PRESENT IN A @PG LINE
+
+    bool updatePP;
+    updatePP = false;
+    string newPP;
+
+    for (int i = lines.size() - 1; i >= 0; i--)
+    {
+        string &line = lines[i];
+        size_t start, value, end;
+        if (updatePP)
+        {
+            if (findTag(line, "PP", start, value, end))
+                line.replace(start, end - start, "\tPP:" + newPP);
+            else
+                line += "\tPP:" + newPP;
+            updatePP = false;
+        }
+        if (!findTag(line, "ID", start, value, end)) // ID SHOULD ALWAYS PRESENT IN A @PG LINE
+            continue;
+        const string ID1 = line.substr(value, end - value);
+        for (auto &ID2 : otherIDs)
+        {
+            if (programID == ID1 || programID == ID2)
+                previousRun = true;
+            if (ID1 == ID2)
+            {
+                string ID = random_string(8, generator);
+                string str = line;
+                str.insert(end, "-" + ID);
+                updatePP = true;
+                newPP = ID1;
+                newPP += "-";
+                newPP += ID;
+                line = str;
+            }
+        }
+    }
+}
+
+bool parseHeader(const string &textHeader, SamHeader &header)
+{
+    const size_t size = textHeader.size();
+    size_t start = 0;
+    while (start < size)
+    {
+        size_t end = textHeader.find('\n', start);
+        if (end == string::npos)
+            end = size;
+        const char *line = textHeader.data() + start;
+        const size_t length = end - start;
+
+        if (strncmp(line, "@HD", 3) == 0)
+        {
+            header.HD.append(line, length);
+        }
+        else if (strncmp(line, "@SQ", 3) == 0)
+        {
+            header.SQ.push_back({line, length});
+        }
+        else if (strncmp(line, "@RG", 3) == 0)
+        {
+            header.RG.emplace_back(line, length);
+        }
+        else if (strncmp(line, "@PG", 3) == 0)
+        {
+            header.PG.emplace_back(line, length);
+        }
+        else if (strncmp(line, "@CO", 3) == 0)
+        {
+            header.CO.emplace_back(line, length);
+        }
+        else
+        {
+            cerr << "Error: Unknown header tag." << endl;
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+string random_string(size_t length, mt19937_64 &generator)
+{
+    auto randchar = [&generator]() -> char {
+        const char charset[] = "0123456789"
+                               "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        const size_t max_index = (sizeof(charset) - 1);
+        return charset[generator() % max_index];
+    };
+    string str(length, 0);
+    generate_n(str.begin(), length, randchar);
+    return str;
+}
+
+void setSortOrder(string &textHeader, const char *sortOrder)
+{
+    if (textHeader.compare(0, 4, "@HD\t") != 0)
+    {
+        // Merged headers without @HD start with an empty line
+        if (textHeader.compare(0, 1, "\n") == 0)
+            textHeader.erase(0, 1);
+        textHeader.insert(0, string("@HD\tVN:1.6\tSO:") + sortOrder + "\n");
+        return;
+    }
+    const size_t lineEnd = min(textHeader.find('\n'), textHeader.size());
+    size_t so = textHeader.find("\tSO:");
+    if (so >= lineEnd)
+    {
+        textHeader.insert(lineEnd, string("\tSO:") + sortOrder);
+        return;
+    }
+    so += 4;
+    const size_t end = min(textHeader.find('\t', so), lineEnd);
+    textHeader.replace(so, end - so, sortOrder);
+}
+
+bool mergeHeaders(const vector<BamInput *> &files,
+                  const vector<const char *> &refNames,
+                  bool unsortedInput,
+                  int argc,
+                  const char *argv[],
+                  mt19937_64 &generator,
+                  string &textHeaderOut,
+                  RefVector &referencesOut,
+                  vector<vector<int32_t>> &refIDMaps)
+{
+    const size_t numFiles = files.size();
+    vector<SamHeader> headers(numFiles);
+    string headerHDout;
+    vector<string> headerRGout;
+
+    for (size_t k = 0; k < numFiles; k++)
+    {
+        if (!parseHeader(files[k]->GetHeaderText(), headers[k]))
+        {
+            cerr << "Error: Unknown header tag." << endl;
+            return false;
+        }
+    }
+
+    for (size_t k = 1; k < numFiles; k++)
+    {
+        if (headers[k].HD.compare(headers[0].HD) != 0)
+        {
+            cerr << "Error: The header lines (@HD) are different." << endl;
+            return false;
+        }
+    }
+    headerHDout = headers[0].HD;
+
+    // The output of --unsorted follows the order in which names are matched
+    if (unsortedInput)
+    {
+        size_t so = headerHDout.find("\tSO:");
+        if (so != string::npos)
+        {
+            size_t end = headerHDout.find('\t', so + 1);
+            headerHDout.replace(so, end == string::npos ? string::npos : end - so, "\tSO:unsorted");
+        }
+    }
+
+    // The @SQ lines must describe the references of the binary header, in the same order
+    for (size_t k = 0; k < numFiles; k++)
+    {
+        if (headers[k].SQ.size() != files[k]->GetReferenceData().size())
+        {
+            cerr << "Error: The header lines (@SQ) of input file " << k + 1
+                 << " do not match its reference sequences." << endl;
+            return false;
+        }
+    }
+
+    // Room for the header and the AN tags, which hold each name once per file at most
+    size_t textSize = 0;
+    size_t numLines = 0;
+    size_t namesSize = 0;
+    for (size_t k = 0; k < numFiles; k++)
+    {
+        textSize += files[k]->GetHeaderText().size();
+        numLines += headers[k].SQ.size();
+        namesSize += strlen(refNames[k]) + 4;
+    }
+    textHeaderOut.clear();
+    textHeaderOut.reserve(2 * textSize + numLines * namesSize);
+    textHeaderOut += headerHDout;
+    textHeaderOut += "\n";
+
+    // Merge @SQ lines, in a single pass over all the dictionaries as if they were sorted. The lines
+    // found in several are written once, and each reference of an input is mapped to the reference
+    // of the output built from its line.
+    referencesOut.clear();
+    refIDMaps.resize(numFiles);
+    vector<string> suffixes(numFiles);
+    vector<LineIndex> indexes;
+    indexes.reserve(numFiles);
+    // When all the dictionaries are sorted, identical lines always meet in the merge
+    bool sorted = true;
+    for (size_t k = 0; k < numFiles; k++)
+    {
+        refIDMaps[k].assign(headers[k].SQ.size(), -1);
+        suffixes[k] = string("-") + refNames[k] + "-" + to_string(k + 1);
+        indexes.emplace_back(headers[k].SQ);
+        sorted = sorted && isSortedSQ(headers[k].SQ);
+    }
+    vector<size_t> next(numFiles, 0);
+    vector<size_t> lines(numFiles); // line of each file written by the current step
+    string copyA, copyB;
+    while (1)
+    {
+        // Smallest line not written yet, skipping the lines already written with their copy in
+        // another dictionary
+        int first = -1;
+        for (size_t k = 0; k < numFiles; k++)
+        {
+            const vector<HeaderLine> &headerSQ = headers[k].SQ;
+            while (next[k] < headerSQ.size() && refIDMaps[k][next[k]] >= 0)
+                next[k]++;
+            if (next[k] < headerSQ.size()
+                && (first < 0
+                    || compareSQ(headerSQ[next[k]], headers[first].SQ[next[first]], copyA, copyB)
+                           < 0))
+                first = k;
+        }
+        if (first < 0)
+            break;
+
+        // The same line may still be further in the other dictionaries if they are not sorted the
+        // same way
+        const HeaderLine &line = headers[first].SQ[next[first]];
+        unsigned mask = 0;
+        for (size_t k = 0; k < numFiles; k++)
+        {
+            const vector<HeaderLine> &headerSQ = headers[k].SQ;
+            long other = -1;
+            if ((int)k == first
+                || (next[k] < headerSQ.size()
+                    && compareSQ(headerSQ[next[k]], line, copyA, copyB) == 0))
+                other = next[k];
+            else if (!sorted)
+                other = indexes[k].Find(line);
+            if (other >= 0 && refIDMaps[k][other] < 0)
+            {
+                lines[k] = other;
+                mask |= 1u << k;
+            }
+        }
+
+        // The reference is taken from the first file holding the line
+        const int lowest = __builtin_ctz(mask);
+        if (!appendSQ(textHeaderOut, headers[lowest].SQ[lines[lowest]], mask, suffixes))
+            return false;
+        for (size_t k = 0; k < numFiles; k++)
+            if (mask & (1u << k))
+                refIDMaps[k][lines[k]] = referencesOut.size();
+        referencesOut.push_back(files[lowest]->GetReferenceData()[lines[lowest]]);
+    }
+
+    // Merge @RG lines
+    // concatenate vectors into 1
+    for (auto &header : headers)
+        headerRGout.insert(headerRGout.end(), header.RG.begin(), header.RG.end());
+
+    // sort vectors
+    sort(headerRGout.begin(), headerRGout.end());
+    // use unique for removing consecutive identical elements //see how to do here:
+    // http://www.cplusplus.com/reference/algorithm/unique/
+    vector<string>::iterator it;
+    it = unique(headerRGout.begin(), headerRGout.end());
+    headerRGout.resize(distance(headerRGout.begin(), it));
+
+    // Update @PG lines, the IDs of each file being made unique against the following files
+    string programID;
+    programID = "\tID:bam-mergeRef";
+    bool previousRun;
+    previousRun = false;
+    for (size_t k = 0; k + 1 < numFiles; k++)
+        for (size_t j = k + 1; j < numFiles; j++)
+            renamePG(headers[k].PG, headers[j].PG, programID, generator, previousRun);
+
+    string newPG;
+    newPG = "@PG";
+    newPG += programID;
+    if (previousRun)
+    {
+        newPG += "-";
+        newPG += random_string(8, generator);
+    }
+    newPG += "\tPN:bam-mergeRef\tPP:";
+    if (!headers[0].PG.empty())
+        newPG += tagValue(headers[0].PG[0], "ID");
+    newPG += "\tCL:";
+    newPG += argv[0];
+    for (int i = 1; i < argc; i++)
+    {
+        newPG += " ";
+        newPG += argv[i];
+    }
+    // OLDEST @PG SHOULD BE THE LAST AND NEWEST @PG SHOULD BE THE FIRST
+
+    // CONCATENATE ALL THE VECTOR IN mHeaderOut
+    for (auto &str : headerRGout)
+        textHeaderOut += str + "\n";
+    textHeaderOut += newPG + "\n";
+    for (auto &header : headers)
+        for (auto &str : header.PG)
+            textHeaderOut += str + "\n";
+    for (auto &header : headers)
+        for (auto &str : header.CO)
+            textHeaderOut += str + "\n";
+    return true;
+}
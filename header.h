@@ -0,0 +1,52 @@
+#ifndef HEADER_H
+#define HEADER_H
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "api/BamAux.h"
+#include "bamio.h"
+
+// A line of a header text, without its newline
+struct HeaderLine
+{
+    const char *Data;
+    size_t Size;
+};
+
+// Lines of a SAM header text, split by record type. The @SQ lines, which can number in the
+// millions, are not copied: they point into the text given to parseHeader().
+struct SamHeader
+{
+    std::string HD;
+    std::vector<HeaderLine> SQ;
+    std::vector<std::string> RG;
+    std::vector<std::string> PG;
+    std::vector<std::string> CO;
+};
+
+bool parseHeader(const std::string &textHeader, SamHeader &header);
+
+std::string random_string(size_t length, std::mt19937_64 &generator);
+
+// Build the header of the output file from the headers of the input files: the @SQ lines get an
+// AN tag naming their reference (refNames[k] for file k + 1) and file numbers, the @RG lines are
+// merged, the @PG IDs found in several files are made unique and a @PG line is added for this run
+// (argc and argv give its command line). referencesOut receives the references of the merged @SQ
+// lines, and refIDMaps[k] the RefID in referencesOut of each reference of file k + 1. Returns
+// false (after printing an error message) if the headers cannot be merged.
+bool mergeHeaders(const std::vector<BamInput *> &files,
+                  const std::vector<const char *> &refNames,
+                  bool unsortedInput,
+                  int argc,
+                  const char *argv[],
+                  std::mt19937_64 &generator,
+                  std::string &textHeaderOut,
+                  BamTools::RefVector &referencesOut,
+                  std::vector<std::vector<int32_t>> &refIDMaps);
+
+// Set the SO tag of the @HD line of a header text, adding the tag (and the line) if needed
+void setSortOrder(std::string &textHeader, const char *sortOrder);
+
+#endif
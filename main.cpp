@@ -1,111 +1,100 @@
 //#include <iostream>
 #include <cstdlib>
-#include <sstream>
 // #include <fstream>
 // #include <cmath>
 #include <cstring>
 #include <popt.h>
-#include <regex>
 #include <string.h>
+#include <sys/stat.h>
 // #include <time.h>
 
-// Required for rand()
-#include <stdlib.h> /* srand, rand */
-#include <time.h>   /* time */
+#include <random>
+#include <time.h> /* time */
+#include <unistd.h>
 
 // #include <BamMultiReader.h>
-#include "api/BamReader.h"
-#include "api/BamWriter.h"
+#include "bamio.h"
+#include "checkpoint.h"
+#include "cram.h"
+#include "hashjoin.h"
+#include "header.h"
+#include "manifest.h"
+#include "md.h"
+#include "merge.h"
+#include "regions.h"
+#include "shard.h"
 
 using namespace std;
 using namespace BamTools;
 
-
-bool isSameCigar(vector<CigarOp> v1, vector<CigarOp> v2)
+// Close and delete the input files
+static void closeInputs(vector<BamInput *> &files)
 {
-    if (v1.size() != v2.size())
-        return false;
-
-    for (int i = 0; i < v1.size(); i++)
+    for (BamInput *file : files)
     {
-        if (v1[i].Type != v2[i].Type)
-            return false;
-        if (v1[i].Length != v2[i].Length)
-            return false;
-    }
-    return true;
-}
-
-bool parseHeader(string textHeader,
-                 string &headerHD,
-                 vector<string> &headerSQ,
-                 vector<string> &headerRG,
-                 vector<string> &headerPG,
-                 vector<string> &headerCO)
-{
-    string line;
-    istringstream iss(textHeader);
-    while (getline(iss, line))
-    {
-        if (strncmp(line.c_str(), "@HD", 3) == 0)
-        {
-            headerHD += line;
-        }
-        else if (strncmp(line.c_str(), "@SQ", 3) == 0)
-        {
-            headerSQ.push_back(line);
-        }
-        else if (strncmp(line.c_str(), "@RG", 3) == 0)
-        {
-            headerRG.push_back(line);
-        }
-        else if (strncmp(line.c_str(), "@PG", 3) == 0)
-        {
-            headerPG.push_back(line);
-        }
-        else if (strncmp(line.c_str(), "@CO", 3) == 0)
-        {
-            headerCO.push_back(line);
-        }
-        else
-        {
-            cerr << "Error: Unknown header tag." << endl;
-            return false;
-        }
+        file->Close();
+        delete file;
     }
-    return true;
-}
-
-string random_string(size_t length)
-{
-    auto randchar = []() -> char {
-        const char charset[] = "0123456789"
-                               "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-        const size_t max_index = (sizeof(charset) - 1);
-        return charset[rand() % max_index];
-    };
-    string str(length, 0);
-    generate_n(str.begin(), length, randchar);
-    return str;
 }
 
 int main(int argc, const char *argv[])
 {
     char *trashFileName = nullptr;
+    char *manifestFileName = nullptr;
     char *logFileName = nullptr;
     char *ref1Name = nullptr;
     char *ref2Name = nullptr;
-
-    /* initialize random seed: */
-    srand(time(NULL));
+    char *refNamesList = nullptr;
+    char *regionsFileName = nullptr;
+    char *fasta1Name = nullptr;
+    char *fasta2Name = nullptr;
+    char *fastaList = nullptr;
+    int mdTarget = 1;
+    int numThreads = 0;
+    int unsortedInput = 0;
+    int memoryLimit = 2048;
+    int numShards = 0;
+    long seed = -1;
+    int queueDepth = 4;
+    int progressInterval = 0;
+    int checkpointInterval = 0;
+    int resumeMerge = 0;
+    int sortOutput = 0;
+    int sortMemory = 768;
+    int uncompressedOutput = 0;
+    int outLevel = Z_DEFAULT_COMPRESSION;
+    int trashLevel = Z_DEFAULT_COMPRESSION;
+    char *nameOrderName = nullptr;
 
     // clang-format off
     struct poptOption optionsTable[] = {
         {"trashfile", 't', POPT_ARG_STRING, &trashFileName, 0, "Set name of file collecting unmapped and other undesirable alignments", "path/name"},
         {"trashfile", 'T', POPT_ARG_NONE, 0, 0, "Generate file collecting unmapped and other undesirable alignments in " "outfilePATH/outfileNAME.trash", NULL},
-        {"logfile", 'l', POPT_ARG_STRING, &logFileName, 0, "Set log file name", "path/name"},
+        {"discard-manifest", '\0', POPT_ARG_STRING, &manifestFileName, 0, "Set name of file listing the discarded read names, with the reason and their alignments in each input file (tab-separated, much smaller than the trash file)", "path/name"},
+        {"logfile", 'l', POPT_ARG_STRING, &logFileName, 0, "Set name of file receiving the counts of kept and discarded reads and the time spent in each stage, as JSON if it ends with .json and as TSV otherwise", "path/name"},
         {"refname1", 'a', POPT_ARG_STRING, &ref1Name, 0, "Set first reference name", "name"},
         {"refname2", 'b', POPT_ARG_STRING, &ref2Name, 0, "Set second reference name", "name"},
+        {"refnames", '\0', POPT_ARG_STRING, &refNamesList, 0, "Set names of all the references, in the order of the input files (instead of -a and -b, needed with more than two input files)", "name1,name2,..."},
+        {"ref1", '\0', POPT_ARG_STRING, &fasta1Name, 0, "Set FASTA file (indexed with samtools faidx) of the first reference, to recompute the MD and NM tags of the output", "path/name"},
+        {"ref2", '\0', POPT_ARG_STRING, &fasta2Name, 0, "Set FASTA file (indexed with samtools faidx) of the second reference", "path/name"},
+        {"fastas", '\0', POPT_ARG_STRING, &fastaList, 0, "Set FASTA files of all the references, in the order of the input files (instead of --ref1 and --ref2)", "file1,file2,..."},
+        {"md-target", '\0', POPT_ARG_INT, &mdTarget, 0, "Set number of the reference the MD and NM tags are recomputed against (default: 1)", "N"},
+        {"uncompressed", 'u', POPT_ARG_NONE, &uncompressedOutput, 0, "Write the output file as uncompressed BAM (BGZF level 0), e.g. to pipe it into another tool (same as --out-level 0)", NULL},
+        {"out-level", '\0', POPT_ARG_INT, &outLevel, 0, "Set compression level of the output file, from 0 (none) to 9 (12 with libdeflate) (default: 6)", "N"},
+        {"trash-level", '\0', POPT_ARG_INT, &trashLevel, 0, "Set compression level of the trash file (default: 6)", "N"},
+        {"name-order", '\0', POPT_ARG_STRING, &nameOrderName, 0, "Set order of the names in the input files, natural (samtools sort -n) or lexicographical (Picard) (default: from the SS tag of the @HD line, else natural)", "order"},
+        {"threads", '@', POPT_ARG_INT, &numThreads, 0, "Set number of threads compressing the output files (default: compress in the main thread)", "N"},
+        {"unsorted", '\0', POPT_ARG_NONE, &unsortedInput, 0, "Input files are not sorted by names: match the reads through a hash table (two input files only)", NULL},
+        {"shards", 's', POPT_ARG_INT, &numShards, 0, "Split the reads into N parts by name and merge the parts on N threads (uses temporary files next to the output file, two input files only)", "N"},
+        {"queue-depth", '\0', POPT_ARG_INT, &queueDepth, 0, "Set number of batches of reads queued between the threads reading the inputs, merging and writing the outputs (default: 4, 0 does everything in the main thread)", "N"},
+        {"seed", '\0', POPT_ARG_LONG, &seed, 0, "Set seed of the choice between identical alignments and of the new @PG IDs, for reproducible outputs (default: current time)", "N"},
+        {"regions", '\0', POPT_ARG_STRING, &regionsFileName, 0, "Only merge the reads overlapping the regions of a BED file, read from input files sorted by coordinates through their BAI or CSI index", "path/name"},
+        {"memory", 'm', POPT_ARG_INT, &memoryLimit, 0, "Set memory used by the hash table of --unsorted before spilling to temporary files (default: 2048)", "MB"},
+        {"sort", '\0', POPT_ARG_NONE, &sortOutput, 0, "Write the output file sorted by coordinates, with a BAI index in outputfile.bai", NULL},
+        {"sort-memory", '\0', POPT_ARG_INT, &sortMemory, 0, "Set memory holding the records of --sort before spilling sorted runs to temporary files (default: 768)", "MB"},
+        {"progress", '\0', POPT_ARG_INT, &progressInterval, 0, "Print the number of records merged and the rate every N seconds on stderr (default: 0, no progress)", "N"},
+        {"checkpoint", '\0', POPT_ARG_INT, &checkpointInterval, 0, "Save the state of the merge in <outputfile>.checkpoint every N seconds, so that it can be resumed if it is killed (default: 0, no checkpoint)", "N"},
+        {"resume", '\0', POPT_ARG_NONE, &resumeMerge, 0, "Resume the merge from <outputfile>.checkpoint, with the same input, output and trash files", NULL},
         POPT_AUTOHELP{NULL, 0, 0, NULL, 0}};
     // clang-format on
 
@@ -115,7 +104,11 @@ int main(int argc, const char *argv[])
     // <trashfile>" ) ;
     poptSetOtherOptionHelp(optCon,
                            "[OPTIONS]* -a <reference name 1> -b <reference name 2> <inputfile1> "
-                           "<inputfile2> <outputfile>");
+                           "<inputfile2> <outputfile>\n"
+                           "  or: [OPTIONS]* --refnames <name1>,...,<nameN> <inputfile1> ... "
+                           "<inputfileN> <outputfile>\n"
+                           "  - as inputfile reads the standard input, as outputfile writes the "
+                           "standard output");
     int rc = poptGetNextOpt(optCon);
     if (rc != -1)
     {
@@ -123,978 +116,532 @@ int main(int argc, const char *argv[])
         return 1;
     }
 
-    // inputfile present?
-    const char *infile1 = poptGetArg(optCon);
-    if (!infile1)
+    // The last argument is the output file, the others are the input files
+    vector<const char *> inputNames;
+    while (const char *arg = poptGetArg(optCon))
+        inputNames.push_back(arg);
+    if (inputNames.size() < 3)
     {
-        cerr << "Error: need inputfile 1 as argument." << endl;
+        cerr << "Error: need "
+             << (inputNames.size() == 0 ? "inputfile 1"
+                 : inputNames.size() == 1 ? "inputfile 2"
+                                          : "outputfile")
+             << " as argument." << endl;
         poptPrintUsage(optCon, stderr, 0);
         return 1;
     }
+    const char *outfile = inputNames.back();
+    inputNames.pop_back();
+    const size_t numInputs = inputNames.size();
 
-    const char *infile2 = poptGetArg(optCon);
-    if (!infile2)
+    if (numInputs > (size_t)MAX_INPUT_FILES)
     {
-        cerr << "Error: need inputfile 2 as argument." << endl;
+        cerr << "Error: at most " << MAX_INPUT_FILES << " input files can be merged." << endl;
         poptPrintUsage(optCon, stderr, 0);
         return 1;
     }
 
-    const char *outfile = poptGetArg(optCon);
-    if (!outfile)
+    // Names of the references, from --refnames or from -a and -b
+    vector<const char *> refNames;
+    if (refNamesList != nullptr)
+    {
+        for (char *name = strtok(refNamesList, ","); name != nullptr; name = strtok(nullptr, ","))
+            refNames.push_back(name);
+    }
+    else if (numInputs == 2 && ref1Name != nullptr && ref2Name != nullptr)
     {
-        cerr << "Error: need outputfile as argument." << endl;
+        refNames.push_back(ref1Name);
+        refNames.push_back(ref2Name);
+    }
+    if (refNames.size() != numInputs)
+    {
+        if (numInputs == 2)
+            cerr << "Error: please provide names for the two references." << endl;
+        else
+            cerr << "Error: please provide a name for each of the " << numInputs
+                 << " references with --refnames." << endl;
         poptPrintUsage(optCon, stderr, 0);
         return 1;
     }
 
-    if (ref1Name == nullptr || ref2Name == nullptr)
+    if (numInputs > 2 && (unsortedInput || numShards > 1))
     {
-        cerr << "Error: please provide names for the two references." << endl;
+        cerr << "Error: --unsorted and --shards only merge two input files." << endl;
         poptPrintUsage(optCon, stderr, 0);
         return 1;
     }
 
-    if (trashFileName == nullptr)
+    if (regionsFileName != nullptr && (unsortedInput || numShards > 1))
     {
-        for (int i = 0; i < argc; i++)
+        cerr << "Error: --regions cannot be combined with --unsorted or --shards." << endl;
+        poptPrintUsage(optCon, stderr, 0);
+        return 1;
+    }
+
+    // FASTA files of the references, from --fastas or from --ref1 and --ref2
+    vector<const char *> fastaNames(numInputs, nullptr);
+    if (fastaList != nullptr)
+    {
+        fastaNames.clear();
+        for (char *name = strtok(fastaList, ","); name != nullptr; name = strtok(nullptr, ","))
+            fastaNames.push_back(name);
+        if (fastaNames.size() != numInputs)
         {
-            if (strcmp(argv[i], "-T") == 0)
-            {
-                trashFileName = (char *)malloc((size_t)strlen(outfile) + 6);
-                strcpy(trashFileName, outfile);
-                strcat(trashFileName, ".trash");
-            }
+            cerr << "Error: please provide a FASTA file for each of the " << numInputs
+                 << " references with --fastas." << endl;
+            poptPrintUsage(optCon, stderr, 0);
+            return 1;
         }
     }
-
-    BamReader *mFile1 = new BamReader;   // Create reader
-    BamReader *mFile2 = new BamReader;   // Create reader
-    BamWriter *mOutFile = new BamWriter; // Create writer
-
-    BamWriter *mTrashFile = nullptr;
-    if (trashFileName != nullptr)
+    else
     {
-        mTrashFile = new BamWriter; // Create writer
+        fastaNames[0] = fasta1Name;
+        fastaNames[1] = fasta2Name;
     }
-
-    // Open infile 1
-    if (!mFile1->Open(infile1))
+    const bool recomputeMD = fastaList != nullptr || fasta1Name != nullptr || fasta2Name != nullptr;
+    if (recomputeMD
+        && (mdTarget < 1 || mdTarget > (int)numInputs || fastaNames[mdTarget - 1] == nullptr))
     {
-        cerr << "Error: Could not open inputfile 1." << endl;
+        cerr << "Error: --md-target must be the number of a reference with a FASTA file." << endl;
         poptPrintUsage(optCon, stderr, 0);
-        delete mFile1;
-        delete mFile2;
-        delete mOutFile;
-        if (mTrashFile != nullptr)
-            delete mTrashFile;
         return 1;
     }
 
-    // Open infile 2
-    if (!mFile2->Open(infile2))
+    // Streams: one input at most, read once from start to end, and the messages printed on stdout
+    // go to stderr if the output takes it
+    size_t numStreams = 0;
+    for (size_t k = 0; k < numInputs; k++)
+    {
+        struct stat st;
+        if (strcmp(inputNames[k], "-") == 0)
+            numStreams++;
+        if (regionsFileName != nullptr
+            && (stat(inputNames[k], &st) != 0 || !S_ISREG(st.st_mode)
+                || isCramFile(inputNames[k])))
+        {
+            cerr << "Error: --regions needs BAM input files that can be read from their index, "
+                    "not streams or CRAM files."
+                 << endl;
+            return 1;
+        }
+    }
+    if (numStreams > 1)
     {
-        cerr << "Error: Could not open inputfile 2." << endl;
+        cerr << "Error: only one input file can be read from the standard input." << endl;
         poptPrintUsage(optCon, stderr, 0);
-        mFile1->Close();
-        delete mFile1;
-        delete mFile2;
-        delete mOutFile;
-        if (mTrashFile != nullptr)
-            delete mTrashFile;
         return 1;
     }
+    const bool outputStream = strcmp(outfile, "-") == 0;
+    if (outputStream || (trashFileName != nullptr && strcmp(trashFileName, "-") == 0))
+    {
+        if (outputStream && trashFileName != nullptr && strcmp(trashFileName, "-") == 0)
+        {
+            cerr << "Error: the output and trash files cannot both be written to the standard "
+                    "output."
+                 << endl;
+            return 1;
+        }
+        cout.rdbuf(cerr.rdbuf());
+    }
 
-    // Both input files successfully opened
-    string textHeader1 = mFile1->GetHeader().ToString();
-    string textHeader2 = mFile2->GetHeader().ToString();
-    string textHeaderOut;
-
-    string line;
-    string headerHD1;
-    vector<string> headerSQ1;
-    vector<string> headerRG1;
-    vector<string> headerPG1;
-    vector<string> headerCO1;
-
-    string headerHD2;
-    vector<string> headerSQ2;
-    vector<string> headerRG2;
-    vector<string> headerPG2;
-    vector<string> headerCO2;
+    NameOrder nameOrder = NAME_ORDER_NATURAL;
+    if (nameOrderName != nullptr)
+    {
+        if (strcmp(nameOrderName, "natural") == 0)
+            nameOrder = NAME_ORDER_NATURAL;
+        else if (strcmp(nameOrderName, "lexicographical") == 0)
+            nameOrder = NAME_ORDER_LEXICOGRAPHICAL;
+        else
+        {
+            cerr << "Error: the name order must be natural or lexicographical." << endl;
+            poptPrintUsage(optCon, stderr, 0);
+            return 1;
+        }
+    }
 
-    string headerHDout;
-    vector<string> headerSQout;
-    vector<string> headerRGout;
-    vector<string> headerPGout;
-    vector<string> headerCOout;
+    vector<Region> regions;
+    if (regionsFileName != nullptr && !readRegions(regionsFileName, regions))
+        return 1;
 
-    if (!parseHeader(textHeader1, headerHD1, headerSQ1, headerRG1, headerPG1, headerCO1))
+    if (queueDepth < 0)
     {
-        cerr << "Error: Unknown header tag." << endl;
-        mFile1->Close();
-        mFile2->Close();
-        delete mFile1;
-        delete mFile2;
-        if (mTrashFile != nullptr)
-            delete mTrashFile;
+        cerr << "Error: the queue depth cannot be negative." << endl;
+        poptPrintUsage(optCon, stderr, 0);
         return 1;
     }
 
-    if (!parseHeader(textHeader2, headerHD2, headerSQ2, headerRG2, headerPG2, headerCO2))
+    if (sortOutput && sortMemory <= 0)
     {
-        cerr << "Error: Unknown header tag." << endl;
-        mFile1->Close();
-        mFile2->Close();
-        delete mFile1;
-        delete mFile2;
-        delete mOutFile;
-        if (mTrashFile != nullptr)
-            delete mTrashFile;
+        cerr << "Error: the memory of --sort must be positive." << endl;
+        poptPrintUsage(optCon, stderr, 0);
         return 1;
     }
 
-    if (headerHD1.compare(headerHD2) == 0)
+    if (uncompressedOutput)
+        outLevel = 0;
+    for (int level : {outLevel, trashLevel})
     {
-        headerHDout = headerHD1;
+        if (level != Z_DEFAULT_COMPRESSION && (level < 0 || level > BGZF_MAX_LEVEL))
+        {
+            cerr << "Error: the compression levels must be between 0 and " << BGZF_MAX_LEVEL
+                 << "." << endl;
+            poptPrintUsage(optCon, stderr, 0);
+            return 1;
+        }
     }
-    else
+
+    if (progressInterval < 0)
     {
-        cerr << "Error: The header lines (@HD) are different." << endl;
-        mFile1->Close();
-        mFile2->Close();
-        delete mFile1;
-        delete mFile2;
-        delete mOutFile;
-        if (mTrashFile != nullptr)
-            delete mTrashFile;
+        cerr << "Error: the progress interval cannot be negative." << endl;
+        poptPrintUsage(optCon, stderr, 0);
         return 1;
     }
 
-    // Merge @SQ lines
-    // Should do a function void mergeSQ(header1, header2, header3)
-    int i = 0, j = 0;
-    regex ANregex(
-        "\tAN:[0-9A-Za-z][0-9A-Za-z\\*\\+\\.@_\\|-]*(,[0-9A-Za-z][0-9A-Za-z\\*\\+\\.@_\\|-]*)*");
-    smatch matchAN;
-
-    regex SNregex("\tSN:([0-9A-Za-z][0-9A-Za-z\\*\\+\\.@_\\|-]*)");
-    smatch matchSN;
+    if (checkpointInterval < 0)
+    {
+        cerr << "Error: the checkpoint interval cannot be negative." << endl;
+        poptPrintUsage(optCon, stderr, 0);
+        return 1;
+    }
 
-    while (i < headerSQ1.size() && j < headerSQ2.size())
+    if (trashFileName == nullptr)
     {
-        // cout << "while1\n";
-        // cout << headerSQ1[i] << headerSQ2[j] << "\n";
-        if (strverscmp(headerSQ1[i].c_str(), headerSQ2[j].c_str()) == 0)
+        for (int i = 0; i < argc; i++)
         {
-            if (!regex_search(headerSQ1[i], matchSN, SNregex))
-            {
-                cerr << "Error: A header line (@SQ) is missing its SN tag in both input files."
-                     << endl;
-                mFile1->Close();
-                mFile2->Close();
-                delete mFile1;
-                delete mFile2;
-                delete mOutFile;
-                if (mTrashFile != nullptr)
-                    delete mTrashFile;
-                return 1;
-            }
-            // cout << matchSN[0] << "\t" << matchSN[1] << "\n";
-
-            string str;
-            if (regex_search(headerSQ1[i], matchAN, ANregex)) // GET SN TO ADD BEFORE REFERENCE NAME
-            {
-                str += matchAN.prefix();
-                str += matchAN[0];
-                str += ",";
-            }
-            else
+            if (strcmp(argv[i], "-T") == 0)
             {
-                str += headerSQ1[i];
-                str += "\tAN:";
-                // cout << matchSN[0] << "\t" << matchSN[1] << "\n";
+                if (outputStream)
+                {
+                    cerr << "Error: -T needs the name of the output file, use -t." << endl;
+                    return 1;
+                }
+                trashFileName = (char *)malloc((size_t)strlen(outfile) + 6);
+                strcpy(trashFileName, outfile);
+                strcat(trashFileName, ".trash");
             }
-            str += matchSN[1];
-            str += "-";
-            str += ref1Name;
-            str += "-1,";
-            str += matchSN[1];
-            str += "-";
-            str += ref2Name;
-            str += "-2";
-            str += matchAN.suffix();
-            // cout << str << "\n";
-            headerSQout.push_back(str);
-            i++;
-            j++;
         }
-        else if (strverscmp(headerSQ1[i].c_str(), headerSQ2[j].c_str()) < 0)
-        {
-            if (!regex_search(headerSQ1[i], matchSN, SNregex))
-            {
-                cerr << "Error: A header line (@SQ) is missing its SN tag in input file 1." << endl;
-                mFile1->Close();
-                mFile2->Close();
-                delete mFile1;
-                delete mFile2;
-                delete mOutFile;
-                if (mTrashFile != nullptr)
-                    delete mTrashFile;
-                return 1;
-            }
+    }
 
-            string str;
-            if (regex_search(headerSQ1[i], matchAN, ANregex)) // GET SN TO ADD BEFORE REFERENCE NAME
-            {
-                str += matchAN.prefix();
-                str += matchAN[0];
-                str += ",";
-            }
-            else
-            {
-                str += headerSQ1[i];
-                str += "\tAN:";
-            }
-            str += matchSN[1];
-            str += "-";
-            str += ref1Name;
-            str += "-1"; // ADD PARENTHESES AROUND REFNAME
-            str += matchAN.suffix();
-            headerSQout.push_back(str);
-            i++;
-        }
-        else
-        {
-            if (!regex_search(headerSQ2[j], matchSN, SNregex))
-            {
-                cerr << "Error: A header line (@SQ) is missing its SN tag in input file 2." << endl;
-                mFile1->Close();
-                mFile2->Close();
-                delete mFile1;
-                delete mFile2;
-                delete mOutFile;
-                if (mTrashFile != nullptr)
-                    delete mTrashFile;
-                return 1;
-            }
-            string str;
-            if (regex_search(headerSQ2[j], matchAN, ANregex)) // GET SN TO ADD BEFORE REFERENCE NAME
-            {
-                str += matchAN.prefix();
-                str += matchAN[0];
-                str += ",";
-            }
-            else
-            {
-                str += headerSQ2[j];
-                str += "\tAN:";
-            }
-            str += matchSN[1];
-            str += "-";
-            str += ref2Name;
-            str += "-2"; // ADD PARENTHESES AROUND REFNAME
-            str += matchAN.suffix();
-            headerSQout.push_back(str);
-            j++;
-        }
+    // CRAM outputs are encoded against the reference of the MD and NM tags
+    if ((hasCramExtension(outfile) || (trashFileName != nullptr && hasCramExtension(trashFileName)))
+        && !recomputeMD)
+    {
+        cerr << "Error: CRAM output files need the FASTA file of the reference they are encoded "
+                "against (--ref1, --ref2 or --fastas, and --md-target)."
+             << endl;
+        poptPrintUsage(optCon, stderr, 0);
+        return 1;
     }
-    while (i < headerSQ1.size())
+
+    // Checkpoints of the default merge, between files that can be truncated and seeked
+    const string checkpointName = string(outfile) + ".checkpoint";
+    Checkpoint resumePoint;
+    if (checkpointInterval > 0 || resumeMerge)
     {
-        // cout << "while2\n";
-        // cout << headerSQ1[i] << "\n";
-        if (!regex_search(headerSQ1[i], matchSN, SNregex))
+        bool cram = hasCramExtension(outfile)
+                    || (trashFileName != nullptr && hasCramExtension(trashFileName));
+        for (size_t k = 0; k < numInputs; k++)
+            cram = cram || isCramFile(inputNames[k]);
+        if (sortOutput || unsortedInput || numShards > 1 || regionsFileName != nullptr
+            || outputStream || numStreams > 0 || cram)
         {
-            cerr << "Error: A header line (@SQ) is missing its SN tag in input file 1." << endl;
-            mFile1->Close();
-            mFile2->Close();
-            delete mFile1;
-            delete mFile2;
-            delete mOutFile;
-            if (mTrashFile != nullptr)
-                delete mTrashFile;
+            cerr << "Error: --checkpoint and --resume need the merge of BAM files sorted by names, "
+                    "into BAM files (not with --sort, --unsorted, --shards, --regions, CRAM files "
+                    "or streams)."
+                 << endl;
+            poptPrintUsage(optCon, stderr, 0);
             return 1;
         }
-        string str;
-        if (regex_search(headerSQ1[i], matchAN, ANregex)) // GET SN TO ADD BEFORE REFERENCE NAME
-        {
-            str += matchAN.prefix();
-            str += matchAN[0];
-            str += ",";
-        }
-        else
+    }
+    if (resumeMerge)
+    {
+        if (!resumePoint.Read(checkpointName))
+            return 1;
+        bool sameFiles = resumePoint.InputNames.size() == numInputs
+                         && (resumePoint.TrashSize > 0) == (trashFileName != nullptr)
+                         && (resumePoint.ManifestSize > 0) == (manifestFileName != nullptr);
+        for (size_t k = 0; sameFiles && k < numInputs; k++)
+            sameFiles = resumePoint.InputNames[k] == inputNames[k];
+        if (!sameFiles)
         {
-            str += headerSQ1[i];
-            str += "\tAN:";
+            cerr << "Error: the checkpoint " << checkpointName
+                 << " was saved for other input, trash or manifest files." << endl;
+            return 1;
         }
-        str += matchSN[1];
-        str += "-";
-        str += ref1Name;
-        str += "-1"; // ADD PARENTHESES AROUND REFNAME
-        str += matchAN.suffix();
-        headerSQout.push_back(str);
-        i++;
+        seed = resumePoint.Seed;
+    }
+
+    vector<BamInput *> mFiles;
+    for (size_t k = 0; k < numInputs; k++)
+    {
+        mFiles.push_back(new BamInput); // Create readers
+        if (fastaNames[k] != nullptr)
+            mFiles[k]->SetCramReference(fastaNames[k]);
+    }
+    BamOutput *mOutFile = new BamOutput; // Create writer
+    if (recomputeMD)
+        mOutFile->SetCramReference(fastaNames[mdTarget - 1]);
+
+    BamOutput *mTrashFile = nullptr;
+    if (trashFileName != nullptr)
+    {
+        mTrashFile = new BamOutput; // Create writer
+        if (recomputeMD)
+            mTrashFile->SetCramReference(fastaNames[mdTarget - 1]);
     }
-    while (j < headerSQ2.size())
+
+    // Open infiles
+    for (size_t k = 0; k < numInputs; k++)
     {
-        // cout << "while3\n";
-        // cout << headerSQ2[j] << "\n";
-        if (!regex_search(headerSQ2[j], matchSN, SNregex))
+        if (!mFiles[k]->Open(inputNames[k]))
         {
-            cerr << "Error: A header line (@SQ) is missing its SN tag in input file 2." << endl;
-            mFile1->Close();
-            mFile2->Close();
-            delete mFile1;
-            delete mFile2;
+            cerr << "Error: Could not open inputfile " << k + 1 << "." << endl;
+            poptPrintUsage(optCon, stderr, 0);
+            closeInputs(mFiles);
             delete mOutFile;
             if (mTrashFile != nullptr)
                 delete mTrashFile;
             return 1;
         }
-        string str;
-        if (regex_search(headerSQ2[j], matchAN, ANregex)) // GET SN TO ADD BEFORE REFERENCE NAME
-        {
-            str += matchAN.prefix();
-            str += matchAN[0];
-            str += ",";
-        }
-        else
-        {
-            str += headerSQ2[j];
-            str += "\tAN:";
-        }
-        str += matchSN[1];
-        str += "-";
-        str += ref2Name;
-        str += "-2"; // ADD PARENTHESES AROUND REFNAME
-        str += matchAN.suffix();
-        headerSQout.push_back(str);
-        j++;
     }
 
-    // Merge @RG lines
-    // concatenate vectors into 1
-    headerRGout.reserve(headerRG1.size() + headerRG2.size()); // preallocate memory
-    headerRGout.insert(headerRGout.end(), headerRG1.begin(), headerRG1.end());
-    headerRGout.insert(headerRGout.end(), headerRG2.begin(), headerRG2.end());
-
-    // sort vectors
-    sort(headerRGout.begin(), headerRGout.end());
-    // use unique for removing consecutive identical elements //see how to do here:
-    // http://www.cplusplus.com/reference/algorithm/unique/
-    vector<string>::iterator it;
-    it = unique(headerRGout.begin(), headerRGout.end());
-    headerRGout.resize(distance(headerRGout.begin(), it));
-
-    // Update @PG lines
-
-    // Regular expression to parse previous ID
-    regex IDregex("\tID:([0-9A-Za-z][0-9A-Za-z\\*\\+\\.@_\\|-]*)");
-    smatch matchID1;
-    smatch matchID2;
+    /* initialize random seed: */
+    if (seed < 0)
+        seed = time(NULL);
+    setMergeSeed(seed);
+    mt19937_64 generator(seed);
 
-    string programID;
-    programID = "\tID:bam-mergeRef";
-    bool previousRun;
-    previousRun = false;
+    // All input files successfully opened
+    string textHeaderOut;
+    RefVector referencesOut;
+    vector<vector<int32_t>> refIDMaps;
+    if (!mergeHeaders(mFiles,
+                      refNames,
+                      unsortedInput || regionsFileName != nullptr,
+                      argc,
+                      argv,
+                      generator,
+                      textHeaderOut,
+                      referencesOut,
+                      refIDMaps))
+    {
+        closeInputs(mFiles);
+        delete mOutFile;
+        if (mTrashFile != nullptr)
+            delete mTrashFile;
+        return 1;
+    }
+    MdTagger mdTagger;
+    if (recomputeMD && !mdTagger.Open(fastaNames, mdTarget, referencesOut))
+    {
+        closeInputs(mFiles);
+        delete mOutFile;
+        if (mTrashFile != nullptr)
+            delete mTrashFile;
+        return 1;
+    }
+    if (recomputeMD)
+        mOutFile->SetMdTagger(&mdTagger);
 
-    regex PPregex("\tPP:([0-9A-Za-z][0-9A-Za-z\\*\\+\\.@_\\|-]*)");
-    smatch matchPP;
+    // Order of the names given by the first input unless set
+    if (nameOrderName == nullptr)
+        nameOrder = headerNameOrder(mFiles[0]->GetHeaderText());
 
-    string previousProgram;
-    bool updatePP;
-    updatePP = false;
-    string newPP;
+    // The records of all inputs are read with the RefIDs of the output
+    for (size_t k = 0; k < numInputs; k++)
+        mFiles[k]->SetRefIDMap(refIDMaps[k]);
 
-    for (int i = headerPG1.size() - 1; i >= 0; i--)
+    // A resumed merge reads the inputs from the records after its checkpoint
+    for (size_t k = 0; resumeMerge && k < numInputs; k++)
     {
-        string str;
-        string ID;
-        if (updatePP)
-        {
-            if (regex_search(headerPG1[i], matchPP, PPregex))
-                str = matchPP.prefix();
-            else
-                str = headerPG1[i];
-            str += "\tPP:";
-            // cout << newPP << "\n";
-            str += newPP;
-            str += matchPP.suffix();
-            headerPG1[i] = str;
-            // cout << "changed to:" << headerPG1[i] << "\n";
-            updatePP = false;
-        }
-        // cout << headerPG1[i] << "\n";
-        regex_search(headerPG1[i], matchID1, IDregex); // ID SHOULD ALWAYS PRESENT IN A @PG LINE
-        // cout << headerPG1[i] << "\n";
-        for (int j = 0; j < headerPG2.size(); j++)
+        if (!mFiles[k]->Seek(resumePoint.InputOffsets[k]))
         {
-            regex_search(headerPG2[j], matchID2, IDregex); // ID SHOULD ALWAYS PRESENT IN A @PG LINE
-            if (programID == matchID1[1] || programID == matchID2[1])
-                previousRun = true;
-            if (matchID1[1] == matchID2[1])
-            {
-                // cout << matchID1[1] << "\t" << matchID2[1] << "\n";
-                str = matchID1.prefix();
-                str += matchID1[0];
-                str += "-";
-                ID = random_string(8);
-                // cout << ID << "\n";
-                str += ID;
-                str += matchID1.suffix();
-                // cout << str << "\n";
-                updatePP = true;
-                newPP = matchID1[1];
-                newPP += "-";
-                newPP += ID;
-                // cout << "newPP:" << newPP << "\n";
-                headerPG1[i] = str;
-            }
+            cerr << "Error: Could not resume inputfile " << k + 1 << " from the checkpoint."
+                 << endl;
+            closeInputs(mFiles);
+            delete mOutFile;
+            if (mTrashFile != nullptr)
+                delete mTrashFile;
+            return 1;
         }
-        // cout << headerPG1[i] << "\n";
-    }
-
-    string newPG;
-    newPG = "@PG";
-    newPG += programID;
-    if (previousRun)
-    {
-        newPG += "-";
-        newPG += random_string(8);
-    }
-    newPG += "\tPN:bam-mergeRef\tPP:";
-    regex_search(headerPG1[0], matchID1, IDregex);
-    newPG += matchID1[1];
-    newPG += "\tCL:";
-    newPG += argv[0];
-    for (int i = 1; i < argc; i++)
-    {
-        newPG += " ";
-        newPG += argv[i];
     }
-    // headerPGout.reserve( headerPG1.size() + headerPG2.size() + 1);
-    // headerPGout.insert( headerPGout.end(), headerPG1.begin(), headerPG1.end() );
-    // OLDEST @PG SHOULD BE THE LAST AND NEWEST @PG SHOULD BE THE FIRST
 
-    // CONCATENATE ALL THE VECTOR IN mHeaderOut
-    textHeaderOut += headerHDout;
-    textHeaderOut += "\n";
-    for (auto str : headerSQout)
-        textHeaderOut += str + "\n";
-    for (auto str : headerRGout)
-        textHeaderOut += str + "\n";
-    textHeaderOut += newPG + "\n";
-    for (auto str : headerPG1)
-        textHeaderOut += str + "\n";
-    for (auto str : headerPG2)
-        textHeaderOut += str + "\n";
-    for (auto str : headerCO1)
-        textHeaderOut += str + "\n";
-    for (auto str : headerCO2)
-        textHeaderOut += str + "\n";
+    // Compression workers shared by both output files
+    BgzfPool *mPool = nullptr;
+    if (numThreads > 0)
+        mPool = new BgzfPool(numThreads);
 
+    // Temporary files are named after the output file, or the process when writing to stdout
+    const string tempPrefix = outputStream ? "bam-mergeRef." + to_string(getpid()) : outfile;
 
     // Open output file
-    if (!mOutFile->Open(outfile,
-                        SamHeader(textHeaderOut),
-                        mFile1->GetReferenceData())) // CHANGE WHICH HEADER IS WRITTEN TO mHeaderOut
+    string outHeader = textHeaderOut;
+    if (sortOutput)
+    {
+        setSortOrder(outHeader, "coordinate");
+        mOutFile->SetSortByCoordinates((size_t)sortMemory << 20, tempPrefix);
+    }
+    // A resumed merge appends to the output files as they were at the checkpoint
+    if (resumeMerge
+            ? !mOutFile->Resume(outfile, resumePoint.OutputSize, outLevel, mPool, queueDepth)
+            : !mOutFile->Open(outfile, outHeader, referencesOut, outLevel, mPool, queueDepth))
     {
         cerr << "Error: Could not write outputfile." << endl;
         poptPrintUsage(optCon, stderr, 0);
-        mFile1->Close();
-        mFile2->Close();
-        delete mFile1;
-        delete mFile2;
+        closeInputs(mFiles);
         delete mOutFile;
         if (mTrashFile != nullptr)
             delete mTrashFile;
+        delete mPool;
         return 1;
     }
-    mOutFile->SetCompressionMode(BamWriter::Compressed);
 
     if (mTrashFile != nullptr)
     {
-        if (!mTrashFile->Open(trashFileName,
-                              SamHeader(textHeaderOut),
-                              mFile1->GetReferenceData())) // MAKE THIS OPTIONAL ! + ADD A SUFFIX
+        if (resumeMerge ? !mTrashFile->Resume(
+                              trashFileName, resumePoint.TrashSize, trashLevel, mPool, queueDepth)
+                        : !mTrashFile->Open(trashFileName,
+                                            textHeaderOut,
+                                            referencesOut,
+                                            trashLevel,
+                                            mPool,
+                                            queueDepth))
         {
             cerr << "Error: Could not write trashfile." << endl;
             poptPrintUsage(optCon, stderr, 0);
-            mFile1->Close();
-            mFile2->Close();
+            closeInputs(mFiles);
             mOutFile->Close();
-            delete mFile1;
-            delete mFile2;
             delete mOutFile;
             delete mTrashFile;
+            delete mPool;
             return 1;
         }
-        mTrashFile->SetCompressionMode(BamWriter::Compressed);
     }
 
-    // Ready to process
-
-    string previousAlnName = "0"; // Check if '0' is first character
-    // If string doesn't work try with : char prevName[20];
-
-    char error = 0;
-
-    // While condition
-    bool readLine1 = false; // readLine1 == false -> a new line should be read
-    bool readLine2 = false;
-    BamAlignment aln1;
-    BamAlignment aln2;
-
-    while (1) // Read all file lines until end of file
+    DiscardManifest *manifest = nullptr;
+    if (manifestFileName != nullptr)
     {
-        if (!readLine1)
-            readLine1 = mFile1->GetNextAlignment(aln1);
-
-        if (!readLine2)
-            readLine2 = mFile2->GetNextAlignment(aln2);
-
-        if (!readLine1 && !readLine2) // If both files are empty exit loop
-        {
-            // Check if corrupted file or normal : end of file ?
-            break; // Exit while
-        }
-
-        // Algorithm
-        //		if(aln1.Name!=aln2.Name) // If not the same name
-        //		{
-        // cerr << "Error: The entries of both BAM files are not identical. Either you do not have
-        // the same sequences in both files or you did not sort the entries by names." << endl;
-        // poptPrintUsage( optCon, stderr, 0 ) ;
-        // error = 1;
-        // break;
-        //		cout << aln1.Name << "\t" << aln2.Name << "\n";
-        if (aln1.Name != aln2.Name)
+        manifest = new DiscardManifest;
+        if (resumeMerge ? !manifest->Resume(
+                              manifestFileName, resumePoint.ManifestSize, numInputs, referencesOut)
+                        : !manifest->Open(manifestFileName, numInputs, referencesOut))
         {
-            BamAlignment *aln;
-            BamReader *mFile;
-            int currentFileNumber;
-
-            // cout << aln1.Name << "\t" << aln2.Name << "\n";
-
-            if (!readLine1)
-                cout << "EOF File1\n";
-            if (!readLine2)
-                cout << "EOF File2\n";
-
-            if ((readLine1) // If lines in File 1
-                && ((strverscmp(aln1.Name.c_str(), aln2.Name.c_str()) < 0)
-                    || readLine2 == false)) // And name1 < name2 or file 2 empty
-            {
-                // cout << "Fichier 1\n";
-                aln = &aln1;
-                mFile = (BamReader *)mFile1;
-                currentFileNumber = 1;
-                readLine1 = false; // readLine1 is treated, next loop should read a new one
-            }
-            else // Else : file 1 empty or name2 < name1 => parse file 2
-            {
-                // cout << "Fichier 2\n";
-                aln = &aln2;
-                mFile = (BamReader *)mFile2;
-                currentFileNumber = 2;
-                readLine2 = false; // readLine2 is treated, next loop should read a new one
-            }
-
-            if (strverscmp(aln->Name.c_str(), previousAlnName.c_str())
-                <= 0) // from string.h // If not sorted // verify that it is the right order (maybe
-                      // change to <0)
-            {
-                // Data are not sorted get out
-                // Or maybe pair that was not previously detected with IsPaired() ???
-                cerr << "Error: Please sort the entries of your BAM files by names. 3" << endl;
-                cerr << aln->Name << "\t" << previousAlnName << endl;
-                poptPrintUsage(optCon, stderr, 0);
-                error = 1;
-                break;
-            }
-            previousAlnName = aln->Name; // Update previous name
-
-            aln->AddTag("RN", "i", currentFileNumber);
-
-            bool mapped = aln->IsMapped();
-            BamAlignment alnNext;
-
-            if (aln->IsPaired())
-            {
-                mFile->GetNextAlignment(alnNext);
-                alnNext.AddTag("RN", "i", currentFileNumber);
-                if (aln->Name != alnNext.Name)
-                {
-                    cerr << "Error: A widow was encountered in file " << currentFileNumber
-                         << ". Check that all paired reads have a mate or sort your BAM files by "
-                            "names"
-                         << endl;
-                    poptPrintUsage(optCon, stderr, 0);
-                    error = 1;
-                    break;
-                }
-                mapped = aln->IsMapped() || alnNext.IsMapped();
-            }
-
-            if (mapped)
-            {
-                mOutFile->SaveAlignment(*aln);
-                if (aln->IsPaired())
-                    mOutFile->SaveAlignment(alnNext);
-            }
-            else
+            cerr << "Error: Could not write discard manifest." << endl;
+            poptPrintUsage(optCon, stderr, 0);
+            closeInputs(mFiles);
+            mOutFile->Close();
+            delete mOutFile;
+            if (mTrashFile != nullptr)
             {
-                if (mTrashFile != nullptr)
-                {
-                    mTrashFile->SaveAlignment(*aln);
-                    if (aln->IsPaired())
-                        mTrashFile->SaveAlignment(alnNext);
-                }
+                mTrashFile->Close();
+                delete mTrashFile;
             }
-            // cout << aln->Name << "\n";
+            delete manifest;
+            delete mPool;
+            return 1;
         }
-        else // both files are treated simultaneously
-        {
-            // cout << "Fichier 1 et 2\n";
-            readLine1 = false; // readLine1 is computed next loop should read a new one
-            readLine2 = false; // readLine2 is computed next loop should read a new one
-            if (strverscmp(aln1.Name.c_str(), previousAlnName.c_str())
-                <= 0) //(aln1.Name<=previousAlnName)
-                      ////(strverscmp(aln1.Name.c_str(),previousAlnName.c_str())<=0) from string.h
-                      //// If not sorted // verify that it is the right order (maybe change to <0)
-            {
-                // Data are not sorted get out
-                // Or maybe pair that was not previously detected with IsPaired() ???
-                cerr << "Error: Please sort the entries of your BAM files by names. 3" << endl;
-                cerr << aln1.Name << "\t" << previousAlnName << endl;
-                poptPrintUsage(optCon, stderr, 0);
-                error = 1;
-                break;
-            }
-            previousAlnName = aln1.Name; // Update previous name
-
-            // If paired
-            if (aln1.IsPaired() && aln2.IsPaired())
-            {
-                // Algorithm pair
-                // Load second mate
-                BamAlignment aln3;
-                BamAlignment aln4;
-                if (!mFile1->GetNextAlignment(aln3) || !mFile2->GetNextAlignment(aln4))
-                {
-                    cerr << "Error: Reached the end of the file (or could not read the next entry) "
-                            "without finding a mate. Check that all paired reads have a mate"
-                         << endl; // SHOULD BE ABLE TO DIFFERENTIATE BETWEEN END OF FILE AND A WRONG
-                                  // LINE...
-                    poptPrintUsage(optCon, stderr, 0);
-                    error = 1;
-                    break;
-                }
-
-                if (aln1.Name != aln3.Name)
-                {
-                    cout << "Warning : Missing mate of " << aln1.Name << " in File 1\n";
-                    readLine1 = true; // aln1 = aln3
-                }
-                if (aln2.Name != aln4.Name)
-                {
-                    cout << "Warning : Missing mate " << aln2.Name << " in File 2\n";
-                    readLine2 = true; // aln2 = aln4
-                }
-
-                /*if((aln1.Name != aln3.Name) || (aln2.Name != aln4.Name))
-                {
-                        cout << aln1.Name << "\t" << aln3.Name << "\t" << aln2.Name << "\t" <<
-                aln4.Name << "\n"; cerr << "Error: A widow was encountered. Check that all paired
-                reads have a mate or sort your BAM files by names" << endl; poptPrintUsage( optCon,
-                stderr, 0 ) ; error = 1; break;
-                }*/
+    }
 
-                // Update previousAlnName is not required because aln3/aln1 and aln4/aln2 have the
-                // same name Algorithm here
-                BamAlignment *alnKeep1;
-                BamAlignment *alnKeep2;
+    // Ready to process
+    MergeStats stats(numInputs);
+    ProgressMeter *progress = nullptr;
+    if (progressInterval > 0)
+        progress = new ProgressMeter(progressInterval);
+    stats.Progress = progress;
+    MergeOutput output = {mOutFile, mTrashFile, &stats, manifest};
+
+    // The counters of a resumed merge go on from the checkpoint
+    Checkpointer *checkpointer = nullptr;
+    if (checkpointInterval > 0 || resumeMerge)
+    {
+        if (resumeMerge)
+            stats.Add(resumePoint.Stats);
+        else
+        {
+            resumePoint.Seed = seed;
+            resumePoint.InputNames.assign(inputNames.begin(), inputNames.begin() + numInputs);
+        }
+        checkpointer = new Checkpointer(checkpointName, checkpointInterval, resumePoint);
+    }
 
-                if (readLine1 && readLine2) // aln3 and aln4 are not mates
-                {
-                    BamAlignment *alnKeep;
-                    if (!aln1.IsMapped())
-                    {
-                        if (!aln2.IsMapped())
-                        {
-                            if (mTrashFile != nullptr)
-                            {
-                                mTrashFile->SaveAlignment(aln1);
-                            }
-                        }
-                        else // aln2 is mapped
-                        {
-                            alnKeep = &aln2;
-                            alnKeep->AddTag("RN", "i", 2); // add tag that only aln2 was mapped
-                        }
-                    }
-                    else // aln1 is mapped
-                    {
-                        if (!aln2.IsMapped())
-                        {
-                            alnKeep = &aln1;
-                            alnKeep->AddTag("RN", "i", 1); // add tag that only aln1 was mapped
-                        }
-                        else // they are both mapped
-                        {
-                            if (aln1.Position != aln2.Position
-                                || !isSameCigar(aln1.CigarData, aln2.CigarData))
-                            {
-                                if (mTrashFile != nullptr)
-                                {
-                                    // cout << aln1.Name << "\t" << aln1.Position << "\t" <<
-                                    // aln2.Name << "\t" << aln2.Position << "\n";
-                                    aln1.AddTag("RN", "i", 1);
-                                    aln1.SetIsPrimaryAlignment(false);
-                                    aln2.AddTag("RN", "i", 2);
-                                    aln2.SetIsPrimaryAlignment(false);
-                                    mTrashFile->SaveAlignment(aln1);
-                                    mTrashFile->SaveAlignment(aln2);
-                                }
-                                aln1 = aln3;
-                                aln2 = aln4;
-                                continue;
-                            }
-                            // Random choice
-                            if (rand() % 2 == 0)
-                            {
-                                alnKeep = &aln1; // Keep aln1
-                            }
-                            else
-                            {
-                                alnKeep = &aln2;
-                            }
-                            alnKeep->AddTag(
-                                "RN", "i", 12); // add tag that both aln1 and aln2 were mapped
-                        }
-                    }
-                    // Write aln to output file
-                    // cout << "Here" << "\n";
-                    mOutFile->SaveAlignment(*alnKeep);
-                }
-                else if (readLine1) // only aln3 is not a mate
-                {
-                    /*if(aln1.IsMapped() && !aln2.IsMapped())
-                    {
-                            // Deal with aln1 and aln4
-                    }
-                    if(!aln1.IsMapped() && aln2.IsMapped())
-                    {
-                            // write aln2 and aln4
-                    }*/
-                    if (mTrashFile != nullptr)
-                    {
-                        aln1.AddTag("RN", "i", 1);
-                        aln2.AddTag("RN", "i", 2);
-                        aln4.AddTag("RN", "i", 2);
-                        // aln1.SetIsPrimaryAlignment(false); SHOULD I ADD THIS?
-                        mTrashFile->SaveAlignment(aln1);
-                        mTrashFile->SaveAlignment(aln2);
-                        mTrashFile->SaveAlignment(aln4);
-                    }
-                }
-                else if (readLine2) // only aln4 is not a mate
-                {
-                    if (mTrashFile != nullptr)
-                    {
-                        aln1.AddTag("RN", "i", 1);
-                        aln3.AddTag("RN", "i", 1);
-                        aln2.AddTag("RN", "i", 2);
-                        mTrashFile->SaveAlignment(aln1);
-                        mTrashFile->SaveAlignment(aln3);
-                        mTrashFile->SaveAlignment(aln2);
-                    }
-                }
-                else // if(!readLine1 && !readLine2) // aln3 and aln4 are mates
-                {
-                    if (!aln1.IsMapped() && !aln3.IsMapped())
-                    {
-                        if (aln2.IsMapped() || aln4.IsMapped())
-                        {
-                            alnKeep1 = &aln2;
-                            alnKeep2 = &aln4;
-                            alnKeep1->AddTag("RN", "i", 2);
-                            alnKeep2->AddTag("RN", "i", 2);
-                        }
-                        else
-                        {
-                            if (mTrashFile != nullptr)
-                            {
-                                mTrashFile->SaveAlignment(aln1);
-                                mTrashFile->SaveAlignment(aln3);
-                            }
-                            continue;
-                        }
-                    }
-                    else
-                    {
-                        if (!aln2.IsMapped() && !aln4.IsMapped())
-                        {
-                            alnKeep1 = &aln1;
-                            alnKeep2 = &aln3;
-                            alnKeep1->AddTag("RN", "i", 1);
-                            alnKeep2->AddTag("RN", "i", 1);
-                        }
-                        else
-                        {
-                            if ((aln1.IsFirstMate() && aln2.IsFirstMate())
-                                || (!aln1.IsFirstMate() && !aln2.IsFirstMate()))
-                            {
-                                if (aln1.Position != aln2.Position
-                                    || !isSameCigar(aln1.CigarData, aln2.CigarData)
-                                    || aln3.Position != aln4.Position
-                                    || !isSameCigar(aln3.CigarData, aln4.CigarData))
-                                // I AM ASSUMING THAT THIS WORKS EVEN WHEN THE READ IS UNMAPPED,
-                                // CHECK THAT!!
-                                {
-                                    if (mTrashFile != nullptr)
-                                    {
-                                        aln1.AddTag("RN", "i", 1);
-                                        aln3.AddTag("RN", "i", 1);
-                                        aln2.AddTag("RN", "i", 2);
-                                        aln4.AddTag("RN", "i", 2);
-                                        aln1.SetIsPrimaryAlignment(false);
-                                        aln2.SetIsPrimaryAlignment(false);
-                                        aln3.SetIsPrimaryAlignment(false);
-                                        aln4.SetIsPrimaryAlignment(false);
-                                        mTrashFile->SaveAlignment(aln1);
-                                        mTrashFile->SaveAlignment(aln2);
-                                        mTrashFile->SaveAlignment(aln3);
-                                        mTrashFile->SaveAlignment(aln4);
-                                    }
-                                    continue;
-                                }
-                            }
-                            else
-                            {
-                                if (aln1.Position != aln4.Position
-                                    || !isSameCigar(aln1.CigarData, aln4.CigarData)
-                                    || aln3.Position != aln2.Position
-                                    || !isSameCigar(aln3.CigarData, aln2.CigarData))
-                                {
-                                    if (mTrashFile != nullptr)
-                                    {
-                                        aln1.AddTag("RN", "i", 1);
-                                        aln3.AddTag("RN", "i", 1);
-                                        aln2.AddTag("RN", "i", 2);
-                                        aln4.AddTag("RN", "i", 2);
-                                        aln1.SetIsPrimaryAlignment(false);
-                                        aln2.SetIsPrimaryAlignment(false);
-                                        aln3.SetIsPrimaryAlignment(false);
-                                        aln4.SetIsPrimaryAlignment(false);
-                                        mTrashFile->SaveAlignment(aln1);
-                                        mTrashFile->SaveAlignment(aln2);
-                                        mTrashFile->SaveAlignment(aln3);
-                                        mTrashFile->SaveAlignment(aln4);
-                                    }
-                                    continue;
-                                }
-                            }
-                            if (rand() % 2 == 0)
-                            {
-                                alnKeep1 = &aln1;
-                                alnKeep2 = &aln3;
-                            }
-                            else
-                            {
-                                alnKeep1 = &aln2;
-                                alnKeep2 = &aln4;
-                            }
-                            alnKeep1->AddTag("RN", "i", 12);
-                            alnKeep2->AddTag("RN", "i", 12);
-                        }
-                    }
-                    // Write aln 1 & 3 or 2 & 4
-                    mOutFile->SaveAlignment(*alnKeep1);
-                    mOutFile->SaveAlignment(*alnKeep2);
-                }
-                if (readLine1)
-                    aln1 = aln3;
-                if (readLine2)
-                    aln2 = aln4;
-            }
-            // else if(aln1.IsPaired() || aln2.IsPaired()) // error in files ?
-            else // not paired
-            {
-                BamAlignment *alnKeep;
-                // Do algorithm
-                if (!aln1.IsMapped())
-                {
-                    if (!aln2.IsMapped())
-                    {
-                        if (mTrashFile != nullptr)
-                        {
-                            mTrashFile->SaveAlignment(aln1);
-                        }
-                        continue; // go to next lines in the input files
-                    }
-                    else // aln2 is mapped
-                    {
-                        alnKeep = &aln2;
-                        alnKeep->AddTag("RN", "i", 2); // add tag that only aln2 was mapped
-                    }
-                }
-                else // aln1 is mapped
-                {
-                    if (!aln2.IsMapped())
-                    {
-                        alnKeep = &aln1;
-                        alnKeep->AddTag("RN", "i", 1); // add tag that only aln1 was mapped
-                    }
-                    else // they are both mapped
-                    {
-                        if (aln1.Position != aln2.Position
-                            || !isSameCigar(aln1.CigarData, aln2.CigarData))
-                        {
-                            if (mTrashFile != nullptr)
-                            {
-                                // cout << aln1.Name << "\t" << aln1.Position << "\t" << aln2.Name
-                                // << "\t" << aln2.Position << "\n";
-                                aln1.AddTag("RN", "i", 1);
-                                aln1.SetIsPrimaryAlignment(false);
-                                aln2.AddTag("RN", "i", 2);
-                                aln2.SetIsPrimaryAlignment(false);
-                                mTrashFile->SaveAlignment(aln1);
-                                mTrashFile->SaveAlignment(aln2);
-                            }
-                            continue;
-                        }
-                        // Random choice
-                        if (rand() % 2 == 0)
-                        {
-                            alnKeep = &aln1; // Keep aln1
-                        }
-                        else
-                        {
-                            alnKeep = &aln2;
-                        }
-                        alnKeep->AddTag(
-                            "RN", "i", 12); // add tag that both aln1 and aln2 were mapped
-                    }
-                }
+    // Hold the smaller file in memory with --unsorted
+    struct stat stat1, stat2;
+    HashJoinOptions hashJoinOptions;
+    hashJoinOptions.MemoryLimit = (size_t)memoryLimit << 20;
+    hashJoinOptions.BuildOnFile1 = stat(inputNames[0], &stat1) == 0
+                                   && stat(inputNames[1], &stat2) == 0
+                                   && stat1.st_size < stat2.st_size;
+    hashJoinOptions.TempPrefix = tempPrefix;
+    hashJoinOptions.HeaderText = textHeaderOut;
+    hashJoinOptions.References = referencesOut;
+    hashJoinOptions.Pool = mPool;
 
-                // Write aln to output file
-                // cout << "Here" << "\n";
-                mOutFile->SaveAlignment(*alnKeep);
-            }
-        }
+    char error = 0;
+    if (numShards > 1)
+    {
+        ShardOptions shardOptions;
+        shardOptions.NumShards = numShards;
+        shardOptions.Sorted = !unsortedInput;
+        shardOptions.HashJoin = hashJoinOptions;
+        shardOptions.TempPrefix = tempPrefix;
+        shardOptions.Order = nameOrder;
+        shardOptions.HeaderText = textHeaderOut;
+        shardOptions.References = referencesOut;
+        shardOptions.Pool = mPool;
+        if (!shardedMerge(*mFiles[0], *mFiles[1], output, shardOptions))
+            error = 1;
+    }
+    else if (regionsFileName != nullptr)
+    {
+        if (!regionMerge(mFiles, inputNames, refIDMaps, regions, nameOrder, output))
+            error = 1;
+    }
+    else if (unsortedInput)
+    {
+        if (!hashJoinMerge(*mFiles[0], *mFiles[1], output, hashJoinOptions))
+            error = 1;
     }
+    else if (!mergeSortedFiles(mFiles, output, queueDepth, nameOrder, checkpointer))
+        error = 1;
 
-    mFile1->Close(); // Close file
-    mFile2->Close();
-    mOutFile->Close();
-    delete mFile1;
-    delete mFile2;
+    closeInputs(mFiles); // Close files
+    if (!mOutFile->Close())
+    {
+        cerr << "Error: Could not write outputfile." << endl;
+        error = 1;
+    }
+    stats.WriteSeconds += mOutFile->WriteSeconds();
     delete mOutFile;
     if (mTrashFile != nullptr)
     {
-        mTrashFile->Close();
+        if (!mTrashFile->Close())
+        {
+            cerr << "Error: Could not write trashfile." << endl;
+            error = 1;
+        }
+        stats.WriteSeconds += mTrashFile->WriteSeconds();
         delete mTrashFile;
     }
+    if (manifest != nullptr)
+    {
+        if (!manifest->Close())
+        {
+            cerr << "Error: Could not write discard manifest." << endl;
+            error = 1;
+        }
+        delete manifest;
+    }
+    delete mPool;
+    delete progress;
+    // The merge has completed, there is nothing to resume
+    if (checkpointer != nullptr && !error)
+        remove(checkpointName.c_str());
+    delete checkpointer;
+
+    if (!error && logFileName != nullptr && !stats.Write(logFileName))
+    {
+        cerr << "Error: Could not write logfile." << endl;
+        error = 1;
+    }
     return error;
 }
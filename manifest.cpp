@@ -0,0 +1,144 @@
+#include "manifest.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace BamTools;
+
+static const char CIGAR_OPERATIONS[] = "MIDNSHP=X";
+// Buffer of the manifest file, the lines are short
+static const size_t MANIFEST_BUFFER_SIZE = 1 << 20;
+
+static void appendNumber(string &buffer, uint64_t number)
+{
+    char digits[20];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + number % 10;
+        number /= 10;
+    } while (number > 0);
+    while (n > 0)
+        buffer += digits[--n];
+}
+
+DiscardManifest::DiscardManifest() : mFile(nullptr), mNumFiles(0), mError(false)
+{
+}
+
+DiscardManifest::~DiscardManifest()
+{
+    if (mFile != nullptr)
+        fclose(mFile);
+}
+
+bool DiscardManifest::Open(const string &filename, int numFiles, const RefVector &references)
+{
+    if (!Resume(filename, 0, numFiles, references))
+        return false;
+    mLine = "#name\treason";
+    for (int k = 0; k < numFiles; k++)
+    {
+        mLine += "\tfile";
+        appendNumber(mLine, k + 1);
+    }
+    mLine += '\n';
+    mError = fwrite(mLine.data(), 1, mLine.size(), mFile) != mLine.size();
+    return !mError;
+}
+
+bool DiscardManifest::Resume(const string &filename,
+                             uint64_t size,
+                             int numFiles,
+                             const RefVector &references)
+{
+    if (size > 0)
+    {
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0 || (uint64_t)st.st_size < size
+            || truncate(filename.c_str(), size) != 0)
+            return false;
+    }
+    mFile = fopen(filename.c_str(), size > 0 ? "ab" : "wb");
+    if (mFile == nullptr)
+        return false;
+    setvbuf(mFile, nullptr, _IOFBF, MANIFEST_BUFFER_SIZE);
+    mNumFiles = numFiles;
+    mRefNames.clear();
+    for (const RefData &reference : references)
+        mRefNames.push_back(reference.RefName);
+    mError = false;
+    return true;
+}
+
+void DiscardManifest::AppendRecord(const BamRecord &rec)
+{
+    if (!rec.IsMapped() || rec.RefID < 0 || rec.RefID >= (int32_t)mRefNames.size())
+    {
+        mLine += '*';
+        return;
+    }
+    mLine += mRefNames[rec.RefID];
+    mLine += ':';
+    appendNumber(mLine, (uint64_t)rec.Position + 1);
+    mLine += ':';
+    if (rec.NumCigarOperations() == 0)
+        mLine += '*';
+    for (int i = 0; i < rec.NumCigarOperations(); i++)
+    {
+        const uint32_t op = rec.CigarOperation(i);
+        appendNumber(mLine, op >> 4);
+        mLine += (op & 0xf) < 9 ? CIGAR_OPERATIONS[op & 0xf] : '?';
+    }
+}
+
+void DiscardManifest::Add(const ReadGroup groups[], TrashReason reason)
+{
+    lock_guard<mutex> lock(mMutex);
+    mLine.clear();
+    for (int k = 0; k < mNumFiles && mLine.empty(); k++)
+        if (groups[k].Count > 0)
+            mLine = groups[k].Records[0]->Name();
+    mLine += '\t';
+    mLine += trashReasonName(reason);
+    for (int k = 0; k < mNumFiles; k++)
+    {
+        const ReadGroup &group = groups[k];
+        mLine += '\t';
+        if (group.Count == 0)
+        {
+            mLine += '-';
+            continue;
+        }
+        const bool swapped = group.Count == 2 && !group.Records[0]->IsFirstMate();
+        for (int r = 0; r < group.Count; r++)
+        {
+            if (r > 0)
+                mLine += ',';
+            AppendRecord(*group.Records[swapped ? 1 - r : r]);
+        }
+    }
+    mLine += '\n';
+    if (fwrite(mLine.data(), 1, mLine.size(), mFile) != mLine.size())
+        mError = true;
+}
+
+bool DiscardManifest::Sync(uint64_t &size)
+{
+    lock_guard<mutex> lock(mMutex);
+    if (mError || fflush(mFile) != 0 || fsync(fileno(mFile)) != 0)
+        return false;
+    const off_t position = ftello(mFile);
+    size = position;
+    return position >= 0;
+}
+
+bool DiscardManifest::Close()
+{
+    if (mFile == nullptr)
+        return !mError;
+    const bool ok = fclose(mFile) == 0 && !mError;
+    mFile = nullptr;
+    return ok;
+}
@@ -0,0 +1,50 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "api/BamAux.h"
+#include "merge.h"
+#include "stats.h"
+
+// Tab-separated list of the discarded read names, much smaller and cheaper to write than the
+// trash file, for counting and looking into the discordances. Each line holds a name, why its
+// records were discarded (as in the logfile) and, for each input file, the alignments of its
+// records as reference:position:CIGAR (1-based position), the first mate first and the mates
+// separated by a comma; '*' stands for an unmapped record and '-' for a file without the name.
+// Can be shared by several threads, each line is written at once.
+class DiscardManifest
+{
+public:
+    DiscardManifest();
+    ~DiscardManifest();
+
+    // Write the header line of numFiles input files, whose records use the RefIDs of references
+    bool Open(const std::string &filename, int numFiles, const BamTools::RefVector &references);
+    // Append to a manifest truncated to size bytes, as saved by Sync()
+    bool Resume(const std::string &filename,
+                uint64_t size,
+                int numFiles,
+                const BamTools::RefVector &references);
+    // Line of the records of one read name in the input files (groups[k] for file k + 1)
+    void Add(const ReadGroup groups[], TrashReason reason);
+    // Write the lines added so far to the disk and return the size of the file
+    bool Sync(uint64_t &size);
+    bool Close();
+
+private:
+    void AppendRecord(const BamRecord &rec);
+
+    FILE *mFile;
+    int mNumFiles;
+    std::vector<std::string> mRefNames; // by RefID
+    std::string mLine;                  // line being written, under mMutex
+    std::mutex mMutex;
+    bool mError;
+};
+
+#endif
@@ -0,0 +1,201 @@
+#include "md.h"
+
+#include <iostream>
+
+using namespace std;
+using namespace BamTools;
+
+static const char CIGAR_OPERATIONS[] = "MIDNSHP=X";
+static const char SEQUENCE_BASES[] = "=ACMGRSVTWYHKDBN";
+
+static int32_t unpackInt32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return (int32_t)(u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24);
+}
+
+static uint16_t unpackUint16(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return u[0] | u[1] << 8;
+}
+
+static void appendInt32(string &buffer, int32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        buffer += (char)((value >> (8 * i)) & 0xff);
+}
+
+static void appendNumber(string &buffer, int number)
+{
+    char digits[12];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + number % 10;
+        number /= 10;
+    } while (number > 0);
+    while (n > 0)
+        buffer += digits[--n];
+}
+
+MdTagger::MdTagger() : mTarget(0)
+{
+}
+
+MdTagger::~MdTagger()
+{
+    for (FastaFile *fasta : mFastas)
+        delete fasta;
+}
+
+bool MdTagger::Open(const vector<const char *> &fastaNames, int target, const RefVector &references)
+{
+    mTarget = target - 1;
+    mFastas.assign(fastaNames.size(), nullptr);
+    mSequences.assign(fastaNames.size(), vector<int>());
+    if (mTarget < 0 || mTarget >= (int)fastaNames.size() || fastaNames[mTarget] == nullptr)
+    {
+        cerr << "Error: No FASTA file given for reference " << target << "." << endl;
+        return false;
+    }
+
+    for (size_t k = 0; k < fastaNames.size(); k++)
+    {
+        if (fastaNames[k] == nullptr)
+            continue;
+        mFastas[k] = new FastaFile;
+        if (!mFastas[k]->Open(fastaNames[k]))
+            return false;
+
+        // Sequences of the output found in the FASTA file with the same length
+        size_t missing = 0;
+        mSequences[k].assign(references.size(), -1);
+        for (size_t r = 0; r < references.size(); r++)
+        {
+            int sequence = mFastas[k]->FindSequence(references[r].RefName);
+            if (sequence >= 0 && mFastas[k]->SequenceLength(sequence) == references[r].RefLength)
+                mSequences[k][r] = sequence;
+            else
+                missing++;
+        }
+        if ((int)k == mTarget && missing > 0)
+            cout << "Warning : " << missing << " reference sequences are not in " << fastaNames[k]
+                 << ", MD and NM are computed against the other references for them\n";
+    }
+    return true;
+}
+
+FastaFile *MdTagger::Reference(const BamRecord &rec, int refNumber, int &sequence)
+{
+    if (rec.RefID < 0 || rec.RefID >= (int32_t)mSequences[mTarget].size())
+        return nullptr;
+    sequence = mSequences[mTarget][rec.RefID];
+    if (sequence >= 0)
+        return mFastas[mTarget];
+    for (char digit : to_string(refNumber))
+    {
+        const size_t k = digit - '1';
+        if (k < mFastas.size() && mFastas[k] != nullptr)
+        {
+            sequence = mSequences[k][rec.RefID];
+            if (sequence >= 0)
+                return mFastas[k];
+        }
+    }
+    return nullptr;
+}
+
+bool MdTagger::Tag(const BamRecord &rec, int refNumber, string &data)
+{
+    if (!rec.IsMapped())
+        return false;
+    int sequence;
+    FastaFile *fasta = Reference(rec, refNumber, sequence);
+    if (fasta == nullptr)
+        return false;
+
+    const char *ref = fasta->Fetch(sequence, rec.Position, rec.Position + rec.ReferenceLength());
+    if (ref == nullptr)
+        return false;
+
+    const string &raw = rec.RawData();
+    const char *p = raw.data();
+    const int64_t queryLength = unpackInt32(p + 16);
+    const unsigned char *query =
+        (const unsigned char *)p + 32 + (uint8_t)p[8] + 4 * unpackUint16(p + 12);
+
+    // Matching bases are counted, mismatches and deletions spelled out with the reference bases
+    mMD.clear();
+    int numEdits = 0;
+    int matches = 0;
+    int64_t r = 0;
+    int64_t q = 0;
+    for (int k = 0; k < rec.NumCigarOperations(); k++)
+    {
+        const uint32_t op = rec.CigarOperation(k);
+        const uint32_t length = op >> 4;
+        switch ((op & 0xf) < 9 ? CIGAR_OPERATIONS[op & 0xf] : '?')
+        {
+        case 'M':
+        case '=':
+        case 'X':
+            if (q + length > queryLength)
+                return false;
+            for (uint32_t i = 0; i < length; i++, q++, r++)
+            {
+                const char base = SEQUENCE_BASES[(query[q / 2] >> (q % 2 == 0 ? 4 : 0)) & 0xf];
+                if (base == ref[r] || base == '=')
+                {
+                    matches++;
+                    continue;
+                }
+                appendNumber(mMD, matches);
+                mMD += ref[r];
+                matches = 0;
+                numEdits++;
+            }
+            break;
+        case 'I':
+            q += length;
+            numEdits += length;
+            break;
+        case 'S':
+            q += length;
+            break;
+        case 'D':
+            appendNumber(mMD, matches);
+            mMD += '^';
+            mMD.append(ref + r, length);
+            matches = 0;
+            r += length;
+            numEdits += length;
+            break;
+        case 'N':
+            r += length;
+            break;
+        default: // H and P
+            break;
+        }
+    }
+    appendNumber(mMD, matches);
+
+    // Copy the record without its MD and NM tags, then append the new ones
+    const char *end = p + raw.size();
+    const char *tag = p + rec.TagsOffset();
+    data.assign(p, tag - p);
+    while (tag < end)
+    {
+        const size_t size = tagSize(tag, end);
+        if (size == 0)
+            return false;
+        if (!(tag[0] == 'M' && tag[1] == 'D') && !(tag[0] == 'N' && tag[1] == 'M'))
+            data.append(tag, size);
+        tag += size;
+    }
+    data.append("MDZ", 3);
+    data.append(mMD.c_str(), mMD.size() + 1);
+    data.append("NMi", 3);
+    appendInt32(data, numEdits);
+    return true;
+}
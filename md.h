@@ -0,0 +1,40 @@
+#ifndef MD_H
+#define MD_H
+
+#include <string>
+#include <vector>
+
+#include "api/BamAux.h"
+#include "bamio.h"
+#include "fasta.h"
+
+// Recompute the MD and NM tags of the merged records against one of the references, so that the
+// output does not mix tags computed against different references.
+class MdTagger
+{
+public:
+    MdTagger();
+    ~MdTagger();
+
+    // fastaNames[k] is the FASTA file of reference k + 1 (nullptr if not given) and target the
+    // number of the reference the tags are computed against; references are those of the output.
+    // Records on a sequence missing from the target are computed against the first reference of
+    // their RN tag that has it. Returns false (after printing an error message) on error.
+    bool Open(const std::vector<const char *> &fastaNames,
+              int target,
+              const BamTools::RefVector &references);
+    // Copy the raw data of a mapped record into data, with the MD and NM tags recomputed and moved
+    // to the end. Returns false if the record is left as it is: unmapped, or not within any of
+    // the references.
+    bool Tag(const BamRecord &rec, int refNumber, std::string &data);
+
+private:
+    FastaFile *Reference(const BamRecord &rec, int refNumber, int &sequence);
+
+    std::vector<FastaFile *> mFastas;         // nullptr: no FASTA given
+    std::vector<std::vector<int>> mSequences; // [k][RefID]: sequence of mFastas[k], -1 if none
+    int mTarget;                              // index in mFastas
+    std::string mMD;
+};
+
+#endif
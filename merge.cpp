@@ -0,0 +1,471 @@
+#include "merge.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+#include "batch.h"
+#include "checkpoint.h"
+#include "manifest.h"
+
+using namespace std;
+using namespace BamTools;
+
+static uint64_t mergeSeed = 0;
+
+void setMergeSeed(uint64_t seed)
+{
+    mergeSeed = seed;
+}
+
+// Choose one of n identical alignments of a read, with a probability of 1/n over names
+static int chooseInput(const BamRecord &rec, int n)
+{
+    // Finalizer of MurmurHash3, spreads every bit of the name hash over the bits that decide
+    uint64_t h = hashReadName(rec.Name(), mergeSeed);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h % n;
+}
+
+// Same reference and position: the first 8 bytes of the raw records. Both records use the RefIDs
+// of the output dictionary.
+static bool isSameLocus(const BamRecord &aln1, const BamRecord &aln2)
+{
+    return memcmp(aln1.RawData().data(), aln2.RawData().data(), 8) == 0;
+}
+
+bool isSameCigar(const BamRecord &aln1, const BamRecord &aln2)
+{
+    const uint16_t numOperations = aln1.NumCigarOperations();
+    return numOperations == aln2.NumCigarOperations()
+           && memcmp(aln1.Cigar(), aln2.Cigar(), 4 * numOperations) == 0;
+}
+
+static void countKept(MergeOutput &output, unsigned mask, int n)
+{
+    if (output.Stats != nullptr)
+        output.Stats->Kept[mask] += n;
+}
+
+static void countTrashed(MergeOutput &output, TrashReason reason, int n)
+{
+    if (output.Stats != nullptr)
+        output.Stats->Trashed[reason] += n;
+}
+
+// Unmapped copies that are written to neither file
+static void countDropped(MergeOutput &output, int n)
+{
+    if (output.Stats != nullptr)
+        output.Stats->DroppedUnmapped += n;
+}
+
+// Line of a discarded name in the manifest
+static void listDiscarded(MergeOutput &output, const ReadGroup groups[], TrashReason reason)
+{
+    if (output.Manifest != nullptr)
+        output.Manifest->Add(groups, reason);
+}
+
+bool saveRecord(BamOutput *file, BamRecord &rec, int refNumber, bool primary)
+{
+    if (!primary)
+        rec.SetIsPrimaryAlignment(false);
+    return file->SaveAlignment(rec, refNumber);
+}
+
+// Name present in only one of the files (groups[k] for file k + 1)
+static void mergeOne(ReadGroup groups[], int k, MergeOutput &output)
+{
+    BamRecord **group = groups[k].Records;
+    const int n = groups[k].Count;
+    const int fileNumber = k + 1;
+    bool mapped = group[0]->IsMapped();
+    if (n == 2)
+        mapped = mapped || group[1]->IsMapped();
+
+    BamOutput *file = mapped ? output.OutFile : output.TrashFile;
+    if (mapped)
+        countKept(output, 1u << (fileNumber - 1), n);
+    else
+    {
+        countTrashed(output, TRASH_UNMAPPED, n);
+        listDiscarded(output, groups, TRASH_UNMAPPED);
+    }
+    if (file == nullptr)
+        return;
+    for (int i = 0; i < n; i++)
+        saveRecord(file, *group[i], fileNumber);
+}
+
+// Name present in several files (listed by present), with n records in each: single-end reads
+// (or widows) if n is 1, both mates of a pair if n is 2
+static void mergeGroups(
+    ReadGroup groups[], const int present[], int numPresent, int n, MergeOutput &output)
+{
+    // Files in which the read, or one of its mates, is mapped
+    int mapped[MAX_INPUT_FILES];
+    int numMapped = 0;
+    for (int i = 0; i < numPresent; i++)
+    {
+        const ReadGroup &group = groups[present[i]];
+        if (group.Records[0]->IsMapped() || (n == 2 && group.Records[1]->IsMapped()))
+            mapped[numMapped++] = present[i];
+    }
+    if (numMapped == 0)
+    {
+        countTrashed(output, TRASH_UNMAPPED, n);
+        countDropped(output, n * (numPresent - 1));
+        listDiscarded(output, groups, TRASH_UNMAPPED);
+        if (output.TrashFile != nullptr)
+        {
+            for (int r = 0; r < n; r++)
+                saveRecord(output.TrashFile, *groups[present[0]].Records[r], 0);
+        }
+        return;
+    }
+
+    // The alignments must be the same in all these files, mate by mate
+    const ReadGroup &first = groups[mapped[0]];
+    unsigned mask = 1u << mapped[0];
+    bool samePositions = true;
+    bool sameCigars = true;
+    for (int i = 1; i < numMapped; i++)
+    {
+        const ReadGroup &group = groups[mapped[i]];
+        const bool swapped =
+            n == 2 && first.Records[0]->IsFirstMate() != group.Records[0]->IsFirstMate();
+        for (int r = 0; r < n; r++)
+        {
+            // An unmapped mate compares by its raw bytes too: the locus of its mate, no CIGAR
+            const BamRecord &aln1 = *first.Records[r];
+            const BamRecord &aln2 = *group.Records[swapped ? 1 - r : r];
+            samePositions = samePositions && isSameLocus(aln1, aln2);
+            sameCigars = sameCigars && isSameCigar(aln1, aln2);
+        }
+        mask |= 1u << mapped[i];
+    }
+    if (!samePositions || !sameCigars)
+    {
+        countTrashed(output, samePositions ? TRASH_CIGAR : TRASH_POSITION, n * numMapped);
+        countDropped(output, n * (numPresent - numMapped));
+        listDiscarded(output, groups, samePositions ? TRASH_CIGAR : TRASH_POSITION);
+        if (output.TrashFile != nullptr)
+        {
+            for (int r = 0; r < n; r++)
+                for (int i = 0; i < numMapped; i++)
+                    saveRecord(output.TrashFile, *groups[mapped[i]].Records[r], mapped[i] + 1,
+                               false);
+        }
+        return;
+    }
+
+    // Random choice between identical alignments
+    const int keep = numMapped > 1 ? mapped[chooseInput(*first.Records[0], numMapped)] : mapped[0];
+    countKept(output, mask, n);
+    countDropped(output, n * (numPresent - numMapped));
+    for (int r = 0; r < n; r++)
+        saveRecord(output.OutFile, *groups[keep].Records[r], refNumber(mask));
+}
+
+// Name present in several files (listed by present) with different numbers of mates, or whose
+// mates could not all be found: all its records are trashed as widows. With TRASH_POSITION, for a
+// name whose records could not all be read, they are trashed as in a position mismatch.
+static void trashPresent(ReadGroup groups[],
+                         const int present[],
+                         int numPresent,
+                         TrashReason reason,
+                         MergeOutput &output)
+{
+    int n = 0;
+    for (int i = 0; i < numPresent; i++)
+        n += groups[present[i]].Count;
+    countTrashed(output, reason, n);
+    listDiscarded(output, groups, reason);
+    if (output.TrashFile != nullptr)
+    {
+        for (int i = 0; i < numPresent; i++)
+        {
+            const ReadGroup &group = groups[present[i]];
+            for (int r = 0; r < group.Count; r++)
+                saveRecord(output.TrashFile, *group.Records[r], present[i] + 1,
+                           reason == TRASH_WIDOW);
+        }
+    }
+}
+
+void mergeRecords(ReadGroup groups[], int numFiles, MergeOutput &output)
+{
+    int present[MAX_INPUT_FILES];
+    int numPresent = 0;
+    bool sameCounts = true;
+    for (int k = 0; k < numFiles; k++)
+    {
+        if (output.Stats != nullptr)
+            output.Stats->RecordsRead[k] += groups[k].Count;
+        if (groups[k].Count == 0)
+            continue;
+        if (numPresent > 0 && groups[k].Count != groups[present[0]].Count)
+            sameCounts = false;
+        present[numPresent++] = k;
+    }
+
+    if (numPresent == 0)
+        return;
+    if (numPresent == 1)
+        mergeOne(groups, present[0], output);
+    else if (!sameCounts) // both mates in some files but only one in others
+        trashPresent(groups, present, numPresent, TRASH_WIDOW, output);
+    else
+    {
+        mergeGroups(groups, present, numPresent, groups[present[0]].Count, output);
+    }
+}
+
+static void trashRecords(ReadGroup groups[], int numFiles, TrashReason reason, MergeOutput &output)
+{
+    int present[MAX_INPUT_FILES];
+    int numPresent = 0;
+    for (int k = 0; k < numFiles; k++)
+    {
+        if (output.Stats != nullptr)
+            output.Stats->RecordsRead[k] += groups[k].Count;
+        if (groups[k].Count > 0)
+            present[numPresent++] = k;
+    }
+    if (numPresent > 0)
+        trashPresent(groups, present, numPresent, reason, output);
+}
+
+void trashIncompletePairs(ReadGroup groups[], int numFiles, MergeOutput &output)
+{
+    trashRecords(groups, numFiles, TRASH_WIDOW, output);
+}
+
+void trashUnresolved(ReadGroup groups[], int numFiles, MergeOutput &output)
+{
+    trashRecords(groups, numFiles, TRASH_POSITION, output);
+}
+
+void mergeRecords(BamRecord *group1[], int n1, BamRecord *group2[], int n2, MergeOutput &output)
+{
+    ReadGroup groups[2];
+    groups[0].Count = n1;
+    groups[1].Count = n2;
+    for (int r = 0; r < 2; r++)
+    {
+        groups[0].Records[r] = r < n1 ? group1[r] : nullptr;
+        groups[1].Records[r] = r < n2 ? group2[r] : nullptr;
+    }
+    mergeRecords(groups, 2, output);
+}
+
+// Apply the merge rules to the name groups of the batches, in name order, until one of the
+// batches is used up (a batch of a file that has ended is never used up). With at most
+// MAX_INPUT_FILES inputs, the smallest name is found by scanning the current group of each batch.
+static bool mergeBatches(vector<GroupBatch> &batches,
+                         vector<size_t> &next,
+                         const vector<char> &eof,
+                         MergeOutput &output)
+{
+    const int numFiles = batches.size();
+    while (1)
+    {
+        NameGroup *groups[MAX_INPUT_FILES];
+        BamRecord *records[MAX_INPUT_FILES];
+        const char *keys[MAX_INPUT_FILES];
+        int first = -1; // file with the smallest name
+        for (int k = 0; k < numFiles; k++)
+        {
+            if (next[k] == batches[k].Groups.size())
+            {
+                if (!eof[k])
+                    return true;
+                groups[k] = nullptr;
+                records[k] = nullptr;
+                continue;
+            }
+            groups[k] = &batches[k].Groups[next[k]];
+            records[k] = batches[k].Records.data() + groups[k]->First;
+            keys[k] = batches[k].Key(*groups[k]);
+            if (first < 0
+                || compareNameKeys(keys[k], groups[k]->KeySize, keys[first], groups[first]->KeySize)
+                       < 0)
+                first = k;
+        }
+        if (first < 0)
+            break;
+
+        // The files holding that name are treated simultaneously
+        ReadGroup readGroups[MAX_INPUT_FILES];
+        int numPresent = 0;
+        bool paired = true;
+        for (int k = 0; k < numFiles; k++)
+        {
+            const bool present =
+                records[k] != nullptr
+                && (k == first
+                    || compareNameKeys(
+                           keys[k], groups[k]->KeySize, keys[first], groups[first]->KeySize)
+                           == 0);
+            readGroups[k].Records[0] = present ? records[k] : nullptr;
+            readGroups[k].Records[1] = present ? records[k] + 1 : nullptr;
+            readGroups[k].Count = present ? groups[k]->Count : 0;
+            if (present)
+            {
+                numPresent++;
+                paired = paired && records[k]->IsPaired();
+            }
+        }
+
+        if (numPresent < numFiles)
+        {
+            for (int k = 0; k < numFiles; k++)
+                if (eof[k])
+                    cout << "EOF File" << k + 1 << "\n";
+        }
+        if (numPresent == 1)
+        {
+            if (groups[first]->Count == 1 && records[first]->IsPaired())
+            {
+                cerr << "Error: A widow was encountered in file " << first + 1
+                     << ". Check that all paired reads have a mate or sort your BAM files by names"
+                     << endl;
+                return false;
+            }
+        }
+        else if (paired)
+        {
+            for (int k = 0; k < numFiles; k++)
+            {
+                if (readGroups[k].Count > 0 && groups[k]->Truncated)
+                {
+                    cerr << "Error: Reached the end of the file (or could not read the next entry) "
+                            "without finding a mate. Check that all paired reads have a mate"
+                         << endl;
+                    return false;
+                }
+            }
+            for (int k = 0; k < numFiles; k++)
+                if (readGroups[k].Count == 1)
+                    cout << "Warning : Missing mate of " << records[k]->Name() << " in File "
+                         << k + 1 << "\n";
+        }
+
+        mergeRecords(readGroups, numFiles, output);
+        for (int k = 0; k < numFiles; k++)
+            if (readGroups[k].Count > 0)
+                next[k]++;
+    }
+    return true;
+}
+
+// Save the state of the merge between two calls of mergeBatches(): the inputs resume from the
+// next group of their batches, after the largest of the names merged last in each batch
+static bool saveCheckpoint(const vector<GroupBatch> &batches,
+                           const vector<size_t> &next,
+                           Checkpointer &checkpointer,
+                           MergeOutput &output)
+{
+    vector<uint64_t> offsets(batches.size());
+    const NameGroup *last = nullptr;
+    const GroupBatch *lastBatch = nullptr;
+    for (size_t k = 0; k < batches.size(); k++)
+    {
+        const GroupBatch &batch = batches[k];
+        offsets[k] = next[k] < batch.Groups.size() ? batch.Groups[next[k]].Offset : batch.EndOffset;
+        if (next[k] == 0)
+            continue;
+        const NameGroup &group = batch.Groups[next[k] - 1];
+        if (last == nullptr
+            || compareNameKeys(
+                   batch.Key(group), group.KeySize, lastBatch->Key(*last), last->KeySize)
+                   > 0)
+        {
+            last = &group;
+            lastBatch = &batch;
+        }
+    }
+    const string lastName =
+        last != nullptr ? lastBatch->Records[last->First].Name() : checkpointer.LastName();
+    return checkpointer.Save(offsets, lastName, output);
+}
+
+bool mergeSortedFiles(const vector<BamInput *> &files,
+                      MergeOutput &output,
+                      size_t queueDepth,
+                      NameOrder order,
+                      Checkpointer *checkpointer)
+{
+    // Each input is read by batches of name groups, the merge decisions are taken for whole
+    // batches and the output records are handed to the writers once per batch
+    const size_t numFiles = files.size();
+    const string lastName = checkpointer != nullptr ? checkpointer->LastName() : string();
+    vector<unique_ptr<GroupReader>> readers(numFiles);
+    for (size_t k = 0; k < numFiles; k++)
+        readers[k].reset(new GroupReader(
+            *files[k], k + 1, MERGE_BATCH_GROUPS, order, queueDepth, lastName));
+    vector<GroupBatch> batches(numFiles);
+    vector<size_t> next(numFiles, 0); // next group of each batch
+    vector<char> eof(numFiles, 0);
+    uint64_t mergedRecords = 0; // for the progress lines, from the counters of a resumed merge
+    if (output.Stats != nullptr)
+    {
+        for (size_t k = 0; k < numFiles; k++)
+            mergedRecords += output.Stats->RecordsRead[k];
+    }
+
+    while (1)
+    {
+        bool ended = true;
+        for (size_t k = 0; k < numFiles; k++)
+        {
+            if (!eof[k] && next[k] == batches[k].Groups.size())
+            {
+                if (!readers[k]->ReadBatch(batches[k]))
+                    return false;
+                next[k] = 0;
+                eof[k] = batches[k].Empty();
+            }
+            ended = ended && eof[k];
+        }
+        if (ended)
+            break;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        if (!mergeBatches(batches, next, eof, output))
+            return false;
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+        output.OutFile->Flush();
+        if (output.TrashFile != nullptr)
+            output.TrashFile->Flush();
+
+        if (output.Stats != nullptr)
+        {
+            output.Stats->DecideSeconds += elapsed.count();
+            uint64_t records = 0;
+            for (size_t k = 0; k < numFiles; k++)
+                records += output.Stats->RecordsRead[k];
+            if (output.Stats->Progress != nullptr)
+                output.Stats->Progress->Add(records - mergedRecords);
+            mergedRecords = records;
+        }
+
+        if (checkpointer != nullptr && checkpointer->Due()
+            && !saveCheckpoint(batches, next, *checkpointer, output))
+            return false;
+    }
+
+    if (output.Stats != nullptr)
+    {
+        for (size_t k = 0; k < numFiles; k++)
+            output.Stats->ReadSeconds += readers[k]->Seconds();
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <vector>
+
+#include "bamio.h"
+#include "namekey.h"
+#include "stats.h"
+
+class Checkpointer;
+class DiscardManifest;
+
+// Most input files of a merge: the RN tag lists the numbers of the files as decimal digits
+const int MAX_INPUT_FILES = 9;
+
+// Destination of the merge decisions
+struct MergeOutput
+{
+    BamOutput *OutFile;
+    BamOutput *TrashFile;      // nullptr: discarded records are dropped
+    MergeStats *Stats;         // nullptr: the decisions are not counted
+    DiscardManifest *Manifest; // nullptr: the discarded names are not listed
+};
+
+// Records of one read name in one input file. A count of 0 means that the name is absent from that
+// file, 1 a single-end read (or a widow) and 2 both mates of a pair.
+struct ReadGroup
+{
+    BamRecord *Records[2];
+    int Count;
+};
+
+// Seed of the choice between identical alignments. The choice only depends on the seed and on
+// the read name, so that it does not depend on the order or the thread in which names are merged.
+void setMergeSeed(uint64_t seed);
+
+// Same CIGAR, compared as the packed operations of the raw records
+bool isSameCigar(const BamRecord &aln1, const BamRecord &aln2);
+
+// Write a record, tagged with the number of the reference(s) it was mapped to (no RN tag if
+// refNumber is 0), and flagged as a secondary alignment unless primary is set.
+bool saveRecord(BamOutput *file, BamRecord &rec, int refNumber, bool primary = true);
+
+// Apply the merge rules to the records of one read name in numFiles input files (groups[k] for
+// file k + 1). A record kept from several files on which they agree is tagged with the numbers of
+// these files, e.g. RN:13 for files 1 and 3.
+void mergeRecords(ReadGroup groups[], int numFiles, MergeOutput &output);
+
+// Same for two files: n1 records from file 1 (group1) and n2 records from file 2 (group2)
+void mergeRecords(BamRecord *group1[], int n1, BamRecord *group2[], int n2, MergeOutput &output);
+
+// Trash the records of one read name whose mates are not all in the groups, e.g. because some
+// were not read, as widows. They would otherwise be merged as single-end reads.
+void trashIncompletePairs(ReadGroup groups[], int numFiles, MergeOutput &output);
+
+// Trash the records of one read name that could not be read from some of the files holding it,
+// e.g. because they lie elsewhere in these files, as a position mismatch: merging the others as if
+// these files did not have the name would keep a read that they may align elsewhere.
+void trashUnresolved(ReadGroup groups[], int numFiles, MergeOutput &output);
+
+// Merge BAM files sorted by names (at most MAX_INPUT_FILES) in the given order, reading them side
+// by side by batches of name groups. With a queue depth, each file is read on its own thread, up
+// to queueDepth batches ahead of the merge. With a checkpointer, the state of the merge is saved
+// between batches when it is due, and the merge starts after its last name (the files must then
+// be positioned at the offsets of its checkpoint). Returns false (after printing an error
+// message) if the files are not sorted or cannot be read.
+bool mergeSortedFiles(const std::vector<BamInput *> &files,
+                      MergeOutput &output,
+                      size_t queueDepth = 0,
+                      NameOrder order = NAME_ORDER_NATURAL,
+                      Checkpointer *checkpointer = nullptr);
+
+#endif
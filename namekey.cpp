@@ -0,0 +1,86 @@
+#include "namekey.h"
+
+using namespace std;
+
+static bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+NameOrder headerNameOrder(const string &textHeader)
+{
+    if (textHeader.compare(0, 4, "@HD\t") != 0)
+        return NAME_ORDER_NATURAL;
+    const string hd = textHeader.substr(0, textHeader.find('\n'));
+    size_t ss = hd.find("\tSS:");
+    if (ss == string::npos)
+        return NAME_ORDER_NATURAL;
+    ss += 4;
+    const string subsort = hd.substr(ss, hd.find('\t', ss) - ss);
+    return subsort == "queryname:lexicographical" ? NAME_ORDER_LEXICOGRAPHICAL : NAME_ORDER_NATURAL;
+}
+
+// A digit and any other character compare as their first bytes do: the '0' marker of a number
+// sorts with the digits. Numbers compare by number of significant digits, then digit by digit.
+// As in strnum_cmp(), the leading zeros only break the ties between names that are otherwise
+// equal: their counts come after a NUL byte that ends the rest of the key, and before which a
+// shorter name sorts first. Names are at most 254 characters, counts fit in a byte.
+void makeNameKey(const char *name, NameOrder order, string &key)
+{
+    key.clear();
+    if (order == NAME_ORDER_LEXICOGRAPHICAL)
+    {
+        key.assign(name);
+        return;
+    }
+
+    char zeros[256];
+    size_t numNumbers = 0;
+    const char *p = name;
+    while (*p != '\0')
+    {
+        if (!isDigit(*p))
+        {
+            key += *p++;
+            continue;
+        }
+        const char *start = p;
+        while (*p == '0')
+            p++;
+        const char *digits = p;
+        while (isDigit(*p))
+            p++;
+        key += '0';
+        key += (char)(p - digits);
+        key.append(digits, p - digits);
+        zeros[numNumbers++] = (char)(digits - start);
+    }
+    key += '\0';
+    key.append(zeros, numNumbers);
+}
+
+string nameOfKey(const string &key, NameOrder order)
+{
+    if (order == NAME_ORDER_LEXICOGRAPHICAL)
+        return key;
+
+    // The NUL byte is never a character of the name, nor skipped over by a number
+    size_t end = 0;
+    while (end < key.size() && key[end] != '\0')
+        end += key[end] == '0' ? 2 + (unsigned char)key[end + 1] : 1;
+    size_t zeros = end + 1; // zero count of the next number
+    string name;
+    for (size_t i = 0; i < end;)
+    {
+        if (key[i] != '0')
+        {
+            name += key[i++];
+            continue;
+        }
+        const size_t numDigits = (unsigned char)key[i + 1];
+        name.append((unsigned char)key[zeros++], '0');
+        name.append(key, i + 2, numDigits);
+        i += 2 + numDigits;
+    }
+    return name;
+}
@@ -0,0 +1,41 @@
+#ifndef NAMEKEY_H
+#define NAMEKEY_H
+
+#include <cstring>
+#include <string>
+
+// Orders of the reads in files sorted by names
+enum NameOrder
+{
+    NAME_ORDER_NATURAL,        // numbers compared by value, as samtools sort -n
+    NAME_ORDER_LEXICOGRAPHICAL // bytes compared one by one, as Picard SortSam
+};
+
+// Order of the files with this header: lexicographical if the SS tag of the @HD line says
+// queryname:lexicographical, natural otherwise
+NameOrder headerNameOrder(const std::string &textHeader);
+
+// Binary key of a read name, so that the keys of two names compare with compareNameKeys() as the
+// names do in the given order. In natural order, each run of digits becomes a '0' marker, its
+// number of significant digits and these digits; the numbers of leading zeros follow a NUL byte
+// at the end of the key.
+void makeNameKey(const char *name, NameOrder order, std::string &key);
+
+// Read name of a key, for error messages
+std::string nameOfKey(const std::string &key, NameOrder order);
+
+// memcmp() order, a key coming before the longer keys that start with it
+inline int compareNameKeys(const char *a, size_t sizeA, const char *b, size_t sizeB)
+{
+    int c = memcmp(a, b, sizeA < sizeB ? sizeA : sizeB);
+    if (c != 0)
+        return c;
+    return sizeA < sizeB ? -1 : sizeA > sizeB ? 1 : 0;
+}
+
+inline int compareNameKeys(const std::string &a, const std::string &b)
+{
+    return compareNameKeys(a.data(), a.size(), b.data(), b.size());
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bounded queue between one producer thread and one consumer thread. The two sides only
+// synchronize through two atomic indices; a side that finds the queue full (or empty) backs off
+// until the other side catches up or the queue is closed. Items are swapped in and out of the
+// slots, so that the buffers they own go back and forth between the threads instead of being
+// reallocated.
+template <typename T> class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity) :
+        mSlots(capacity + 1),
+        mHead(0),
+        mTail(0),
+        mClosed(false)
+    {
+    }
+
+    // Move item into the queue, item receives a recycled one. Returns false if the queue was
+    // closed by the consumer.
+    bool Push(T &item)
+    {
+        const size_t tail = mTail.load(std::memory_order_relaxed);
+        const size_t next = (tail + 1) % mSlots.size();
+        for (int i = 0; next == mHead.load(std::memory_order_acquire); i++)
+        {
+            if (mClosed.load(std::memory_order_acquire))
+                return false;
+            backOff(i);
+        }
+        std::swap(mSlots[tail], item);
+        mTail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Take the next item, giving item back to the queue for reuse. Returns false once the queue
+    // is closed and empty.
+    bool Pop(T &item)
+    {
+        const size_t head = mHead.load(std::memory_order_relaxed);
+        for (int i = 0; head == mTail.load(std::memory_order_acquire); i++)
+        {
+            if (mClosed.load(std::memory_order_acquire))
+            {
+                // Items pushed right before the queue was closed are still delivered
+                if (head != mTail.load(std::memory_order_acquire))
+                    break;
+                return false;
+            }
+            backOff(i);
+        }
+        std::swap(mSlots[head], item);
+        mHead.store((head + 1) % mSlots.size(), std::memory_order_release);
+        return true;
+    }
+
+    // Called by the producer after its last item, or by either side to stop the other one
+    void Close()
+    {
+        mClosed.store(true, std::memory_order_release);
+    }
+
+private:
+    static void backOff(int attempt)
+    {
+        if (attempt < 64)
+            return;
+        else if (attempt < 256)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    std::vector<T> mSlots; // one slot is always left free to tell a full queue from an empty one
+    std::atomic<size_t> mHead;
+    std::atomic<size_t> mTail;
+    std::atomic<bool> mClosed;
+};
+
+#endif
@@ -0,0 +1,292 @@
+#include "regions.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+
+#include "bamindex.h"
+
+using namespace std;
+using namespace BamTools;
+
+// Records of one read name: indexes in the records read from each file
+struct RegionGroup
+{
+    size_t Records[MAX_INPUT_FILES][2];
+    int Count[MAX_INPUT_FILES];
+};
+
+// Intervals of the regions on one reference, sorted and without overlaps
+typedef vector<pair<int64_t, int64_t>> Intervals;
+
+static int32_t unpackInt32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return (int32_t)(u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24);
+}
+
+bool readRegions(const string &filename, vector<Region> &regions)
+{
+    ifstream in(filename);
+    if (!in)
+    {
+        cerr << "Error: Could not read regions file " << filename << "." << endl;
+        return false;
+    }
+
+    string line;
+    for (int lineNumber = 1; getline(in, line); lineNumber++)
+    {
+        if (line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0
+            || line.compare(0, 7, "browser") == 0)
+            continue;
+        istringstream fields(line);
+        Region region;
+        if (!(fields >> region.Name >> region.Begin >> region.End) || region.Begin < 0
+            || region.End < region.Begin)
+        {
+            cerr << "Error: Invalid region at line " << lineNumber << " of " << filename << "."
+                 << endl;
+            return false;
+        }
+        regions.push_back(region);
+    }
+    return true;
+}
+
+static void mergeIntervals(Intervals &intervals)
+{
+    sort(intervals.begin(), intervals.end());
+    size_t merged = 0;
+    for (size_t k = 0; k < intervals.size(); k++)
+    {
+        if (merged > 0 && intervals[k].first <= intervals[merged - 1].second)
+            intervals[merged - 1].second = max(intervals[merged - 1].second, intervals[k].second);
+        else
+            intervals[merged++] = intervals[k];
+    }
+    intervals.resize(merged);
+}
+
+static bool overlaps(const Intervals &intervals, int64_t begin, int64_t end)
+{
+    // First interval that ends after begin
+    auto it = upper_bound(intervals.begin(),
+                          intervals.end(),
+                          begin,
+                          [](int64_t pos, const pair<int64_t, int64_t> &interval) {
+                              return pos < interval.second;
+                          });
+    return it != intervals.end() && it->first < end;
+}
+
+// End of the reference bases covered by an alignment. Unmapped reads placed at the position of
+// their mate cover one base.
+static int64_t alignmentEnd(const BamRecord &rec)
+{
+    return rec.Position + max(rec.ReferenceLength(), (int64_t)1);
+}
+
+// Read the mates of the records of file k whose mate lies outside of the regions, at the locus
+// given by their next_refID and next_pos. The mates of a record match its next_refID and next_pos
+// as its first 8 bytes, both in RefIDs of the output. Unplaced mates cannot be found.
+static bool readMates(BamInput &file,
+                      const BamIndex &index,
+                      size_t k,
+                      const vector<int32_t> &refIDMap,
+                      unordered_map<string, RegionGroup> &groups,
+                      vector<BamRecord> &records)
+{
+    vector<int32_t> fileRefIDs; // by RefID of the output
+    for (size_t r = 0; r < refIDMap.size(); r++)
+    {
+        if (refIDMap[r] >= (int32_t)fileRefIDs.size())
+            fileRefIDs.resize(refIDMap[r] + 1, -1);
+        fileRefIDs[refIDMap[r]] = r;
+    }
+
+    vector<IndexChunk> chunks;
+    unordered_map<string, RegionGroup *> widows;
+    for (auto &entry : groups)
+    {
+        RegionGroup &group = entry.second;
+        if (group.Count[k] != 1 || !records[group.Records[k][0]].IsPaired())
+            continue;
+        const char *raw = records[group.Records[k][0]].RawData().data();
+        const int32_t mateRefID = unpackInt32(raw + 20);
+        const int32_t matePosition = unpackInt32(raw + 24);
+        if (mateRefID < 0 || mateRefID >= (int32_t)fileRefIDs.size()
+            || fileRefIDs[mateRefID] < 0 || matePosition < 0)
+            continue;
+        index.AddChunks(fileRefIDs[mateRefID], matePosition, matePosition + 1, chunks);
+        widows.emplace(entry.first, &group);
+    }
+    mergeChunks(chunks);
+
+    BamRecord rec;
+    for (const IndexChunk &chunk : chunks)
+    {
+        if (file.Seek(chunk.Begin))
+        {
+            while (file.Tell() < chunk.End && file.GetNextAlignmentCore(rec))
+            {
+                auto it = widows.find(rec.Name());
+                if (it == widows.end())
+                    continue;
+                RegionGroup &group = *it->second;
+                const BamRecord &mate = records[group.Records[k][0]];
+                if (group.Count[k] != 1 || rec.IsFirstMate() == mate.IsFirstMate()
+                    || memcmp(rec.RawData().data(), mate.RawData().data() + 20, 8) != 0)
+                    continue;
+                // The first mate first, as in a file sorted by names
+                group.Records[k][1] = records.size();
+                if (rec.IsFirstMate())
+                    swap(group.Records[k][0], group.Records[k][1]);
+                group.Count[k] = 2;
+                records.push_back(rec);
+            }
+        }
+        if (file.HasError())
+            return false;
+    }
+    return true;
+}
+
+bool regionMerge(const vector<BamInput *> &files,
+                 const vector<const char *> &fileNames,
+                 const vector<vector<int32_t>> &refIDMaps,
+                 const vector<Region> &regions,
+                 NameOrder order,
+                 MergeOutput &output)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    const size_t numFiles = files.size();
+    vector<vector<BamRecord>> records(numFiles);
+    unordered_map<string, RegionGroup> groups;
+    set<string> missing; // names of the regions found in none of the files
+    for (const Region &region : regions)
+        missing.insert(region.Name);
+
+    for (size_t k = 0; k < numFiles; k++)
+    {
+        BamIndex index;
+        if (!index.Open(fileNames[k]))
+        {
+            cerr << "Error: Could not read the index of inputfile " << k + 1 << " ("
+                 << fileNames[k] << ".bai or .csi)." << endl;
+            return false;
+        }
+
+        const RefVector &references = files[k]->GetReferenceData();
+        unordered_map<string, int32_t> refIDs;
+        for (size_t r = 0; r < references.size(); r++)
+            refIDs.emplace(references[r].RefName, r);
+
+        // Parts of the file to read, and intervals by RefID of the output to keep the records
+        // that overlap them
+        vector<IndexChunk> chunks;
+        unordered_map<int32_t, Intervals> intervals;
+        for (const Region &region : regions)
+        {
+            auto it = refIDs.find(region.Name);
+            if (it == refIDs.end())
+                continue;
+            missing.erase(region.Name);
+            index.AddChunks(it->second, region.Begin, region.End, chunks);
+            intervals[refIDMaps[k][it->second]].emplace_back(region.Begin, region.End);
+        }
+        mergeChunks(chunks);
+        for (auto &entry : intervals)
+            mergeIntervals(entry.second);
+
+        BamRecord rec;
+        for (const IndexChunk &chunk : chunks)
+        {
+            if (files[k]->Seek(chunk.Begin))
+            {
+                while (files[k]->Tell() < chunk.End && files[k]->GetNextAlignmentCore(rec))
+                {
+                    auto it = intervals.find(rec.RefID);
+                    if (it == intervals.end()
+                        || !overlaps(it->second, rec.Position, alignmentEnd(rec)))
+                        continue;
+                    RegionGroup &group = groups[rec.Name()];
+                    if (group.Count[k] == 2)
+                    {
+                        cerr << "Error: More than two records are named " << rec.Name()
+                             << " in inputfile " << k + 1 << "." << endl;
+                        return false;
+                    }
+                    group.Records[k][group.Count[k]++] = records[k].size();
+                    records[k].push_back(rec);
+                }
+            }
+            if (files[k]->HasError())
+            {
+                cerr << "Error: Could not read inputfile " << k + 1 << "." << endl;
+                return false;
+            }
+        }
+        if (!readMates(*files[k], index, k, refIDMaps[k], groups, records[k]))
+        {
+            cerr << "Error: Could not read inputfile " << k + 1 << "." << endl;
+            return false;
+        }
+    }
+    for (const string &name : missing)
+        cout << "Warning : No reference named " << name << " in the input files\n";
+
+    chrono::steady_clock::time_point read = chrono::steady_clock::now();
+
+    // Names in the order of the sorted merge
+    typedef pair<string, RegionGroup *> NamedGroup;
+    vector<NamedGroup> names(groups.size());
+    size_t n = 0;
+    for (auto &entry : groups)
+    {
+        makeNameKey(entry.first.c_str(), order, names[n].first);
+        names[n++].second = &entry.second;
+    }
+    sort(names.begin(), names.end(), [](const NamedGroup &a, const NamedGroup &b) {
+        return compareNameKeys(a.first, b.first) < 0;
+    });
+
+    for (auto &name : names)
+    {
+        const RegionGroup &group = *name.second;
+        ReadGroup readGroups[MAX_INPUT_FILES];
+        bool complete = true; // no pair with a mate left unread
+        bool everywhere = true; // read from every file, none holds it only elsewhere
+        for (size_t k = 0; k < numFiles; k++)
+        {
+            readGroups[k].Count = group.Count[k];
+            for (int r = 0; r < 2; r++)
+                readGroups[k].Records[r] =
+                    r < group.Count[k] ? &records[k][group.Records[k][r]] : nullptr;
+            if (group.Count[k] == 1 && readGroups[k].Records[0]->IsPaired())
+                complete = false;
+            if (group.Count[k] == 0)
+                everywhere = false;
+        }
+        if (!complete)
+            trashIncompletePairs(readGroups, numFiles, output);
+        else if (!everywhere)
+            trashUnresolved(readGroups, numFiles, output);
+        else
+            mergeRecords(readGroups, numFiles, output);
+    }
+
+    if (output.Stats != nullptr)
+    {
+        chrono::duration<double> readSeconds = read - start;
+        chrono::duration<double> decideSeconds = chrono::steady_clock::now() - read;
+        output.Stats->ReadSeconds += readSeconds.count();
+        output.Stats->DecideSeconds += decideSeconds.count();
+    }
+    return true;
+}
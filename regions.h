@@ -0,0 +1,39 @@
+#ifndef REGIONS_H
+#define REGIONS_H
+
+#include <string>
+#include <vector>
+
+#include "bamio.h"
+#include "merge.h"
+
+// Interval of a BED file: 0-based, end excluded
+struct Region
+{
+    std::string Name; // reference sequence
+    int64_t Begin;
+    int64_t End;
+};
+
+// Read the first three columns of a BED file. Header, track and browser lines are skipped.
+// Returns false (after printing an error message) if the file cannot be read.
+bool readRegions(const std::string &filename, std::vector<Region> &regions);
+
+// Merge the reads of BAM files sorted by coordinates that overlap the regions, with the same rules
+// as mergeSortedFiles(). Only the parts of the files that the BAI or CSI index of each file
+// (fileNames[k] + .bai, ...) points to are read. The records found are held in memory and merged
+// by read name, in the given name order. The mate of a read that lies outside of the regions is
+// read from the locus its next_refID and next_pos give; a pair whose mate cannot be found (e.g.
+// unplaced) is trashed as a widow rather than merged one mate at a time. A read that lies outside
+// of the regions in some files cannot be compared with its alignments there and is trashed as a
+// position mismatch, as is a read that some files do not have at all. refIDMaps[k] gives the
+// RefIDs of the output for the references of file k + 1, as set with BamInput::SetRefIDMap().
+// Returns false (after printing an error message) on error.
+bool regionMerge(const std::vector<BamInput *> &files,
+                 const std::vector<const char *> &fileNames,
+                 const std::vector<std::vector<int32_t>> &refIDMaps,
+                 const std::vector<Region> &regions,
+                 NameOrder order,
+                 MergeOutput &output);
+
+#endif
@@ -0,0 +1,248 @@
+#include "shard.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Independent of the salts used by hashJoinMerge() within a shard
+static const uint64_t SHARD_SALT = 0x5348415244;
+// The temporary files are read back once, favour speed over size
+static const int SHARD_COMPRESSION_LEVEL = 1;
+
+static string shardFileName(const ShardOptions &options, int k, const string &kind)
+{
+    return options.TempPrefix + ".part" + to_string(k) + "." + kind + ".bam";
+}
+
+// Split both inputs into the shard files, with the header of the output since the records carry
+// its RefIDs. Sorted inputs are checked here since each shard only sees a part of the names.
+static bool partitionInputs(BamInput *files[2], const ShardOptions &options)
+{
+    for (int side = 0; side < 2; side++)
+    {
+        bool ok = true;
+        vector<BamOutput> shards(options.NumShards);
+        for (int k = 0; k < options.NumShards && ok; k++)
+        {
+            string name = shardFileName(options, k, "in" + to_string(side + 1));
+            if (!shards[k].Open(name,
+                                options.HeaderText,
+                                options.References,
+                                SHARD_COMPRESSION_LEVEL,
+                                options.Pool))
+            {
+                cerr << "Error: Could not write temporary file " << name << "." << endl;
+                ok = false;
+            }
+        }
+
+        string key;
+        string previousKey;
+        BamRecord rec;
+        while (ok && files[side]->GetNextAlignmentCore(rec))
+        {
+            if (options.Sorted)
+            {
+                makeNameKey(rec.Name(), options.Order, key);
+                if (compareNameKeys(key, previousKey) < 0)
+                {
+                    cerr << "Error: Please sort the entries of your BAM files by names." << endl;
+                    cerr << rec.Name() << "\t" << nameOfKey(previousKey, options.Order) << endl;
+                    ok = false;
+                    break;
+                }
+                previousKey.swap(key);
+            }
+            shards[hashReadName(rec.Name(), SHARD_SALT) % options.NumShards].SaveAlignment(rec);
+        }
+        if (ok && files[side]->HasError())
+        {
+            cerr << "Error: Could not read inputfile " << side + 1 << "." << endl;
+            ok = false;
+        }
+
+        for (int k = 0; k < options.NumShards; k++)
+        {
+            if (!shards[k].Close() && ok)
+            {
+                cerr << "Error: Could not write temporary file "
+                     << shardFileName(options, k, "in" + to_string(side + 1)) << "." << endl;
+                ok = false;
+            }
+        }
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+// Merge the inputs of shard k into its own output (and trash) file, counting the decisions in
+// stats and listing the discarded names in the shared manifest (if not nullptr)
+static bool mergeShard(
+    int k, const ShardOptions &options, bool trash, MergeStats *stats, DiscardManifest *manifest)
+{
+    BamInput file1;
+    BamInput file2;
+    BamOutput outFile;
+    BamOutput trashFile;
+    if (!file1.Open(shardFileName(options, k, "in1"))
+        || !file2.Open(shardFileName(options, k, "in2")))
+    {
+        cerr << "Error: Could not read temporary files of part " << k << "." << endl;
+        return false;
+    }
+    if (!outFile.Open(shardFileName(options, k, "out"),
+                      options.HeaderText,
+                      options.References,
+                      SHARD_COMPRESSION_LEVEL,
+                      options.Pool)
+        || (trash
+            && !trashFile.Open(shardFileName(options, k, "trash"),
+                               options.HeaderText,
+                               options.References,
+                               SHARD_COMPRESSION_LEVEL,
+                               options.Pool)))
+    {
+        cerr << "Error: Could not write temporary files of part " << k << "." << endl;
+        return false;
+    }
+
+    MergeOutput output = {&outFile, trash ? &trashFile : nullptr, stats, manifest};
+    bool ok;
+    if (options.Sorted)
+    {
+        ok = mergeSortedFiles({&file1, &file2}, output, 0, options.Order);
+    }
+    else
+    {
+        HashJoinOptions hashJoin = options.HashJoin;
+        hashJoin.MemoryLimit /= options.NumShards;
+        hashJoin.TempPrefix = shardFileName(options, k, "join");
+        ok = hashJoinMerge(file1, file2, output, hashJoin);
+    }
+
+    file1.Close();
+    file2.Close();
+    if (!outFile.Close() || (trash && !trashFile.Close()))
+    {
+        if (ok)
+            cerr << "Error: Could not write temporary files of part " << k << "." << endl;
+        ok = false;
+    }
+    if (stats != nullptr)
+        stats->WriteSeconds += outFile.WriteSeconds() + trashFile.WriteSeconds();
+    return ok;
+}
+
+// Merge the outputs of the shards back by name, or concatenate them if the inputs are unsorted
+static bool collectShards(const string &kind, BamOutput *file, const ShardOptions &options)
+{
+    vector<BamInput> inputs(options.NumShards);
+    vector<BamRecord> records(options.NumShards);
+    vector<string> keys(options.NumShards); // of the names of records
+    for (int k = 0; k < options.NumShards; k++)
+    {
+        if (!inputs[k].Open(shardFileName(options, k, kind)))
+        {
+            cerr << "Error: Could not read temporary file " << shardFileName(options, k, kind)
+                 << "." << endl;
+            return false;
+        }
+    }
+
+    if (options.Sorted)
+    {
+        // The reads of one name are all in the same shard, the heap only orders different names
+        auto after = [&keys](int a, int b) {
+            return compareNameKeys(keys[a], keys[b]) > 0;
+        };
+        auto readNext = [&](int k) {
+            if (!inputs[k].GetNextAlignmentCore(records[k]))
+                return false;
+            makeNameKey(records[k].Name(), options.Order, keys[k]);
+            return true;
+        };
+        priority_queue<int, vector<int>, decltype(after)> heap(after);
+        for (int k = 0; k < options.NumShards; k++)
+            if (readNext(k))
+                heap.push(k);
+        while (!heap.empty())
+        {
+            int k = heap.top();
+            heap.pop();
+            file->SaveAlignment(records[k]);
+            if (readNext(k))
+                heap.push(k);
+        }
+    }
+    else
+    {
+        for (int k = 0; k < options.NumShards; k++)
+            while (inputs[k].GetNextAlignmentCore(records[k]))
+                file->SaveAlignment(records[k]);
+    }
+
+    for (int k = 0; k < options.NumShards; k++)
+    {
+        if (inputs[k].HasError())
+        {
+            cerr << "Error: Could not read temporary file " << shardFileName(options, k, kind)
+                 << "." << endl;
+            return false;
+        }
+        inputs[k].Close();
+    }
+    return true;
+}
+
+
+bool shardedMerge(BamInput &file1,
+                  BamInput &file2,
+                  MergeOutput &output,
+                  const ShardOptions &options)
+{
+    BamInput *files[2] = {&file1, &file2};
+    const bool trash = output.TrashFile != nullptr;
+
+    bool ok = partitionInputs(files, options);
+    if (ok)
+    {
+        vector<char> results(options.NumShards, 0);
+        vector<MergeStats> stats(options.NumShards);
+        vector<thread> workers;
+        for (int k = 0; k < options.NumShards; k++)
+        {
+            MergeStats *shardStats = nullptr;
+            if (output.Stats != nullptr)
+            {
+                shardStats = &stats[k];
+                shardStats->Progress = output.Stats->Progress;
+            }
+            workers.emplace_back([&, k, shardStats] {
+                results[k] = mergeShard(k, options, trash, shardStats, output.Manifest);
+            });
+        }
+        for (auto &worker : workers)
+            worker.join();
+        for (int k = 0; k < options.NumShards; k++)
+        {
+            ok = ok && results[k];
+            if (output.Stats != nullptr)
+                output.Stats->Add(stats[k]);
+        }
+    }
+    if (ok)
+        ok = collectShards("out", output.OutFile, options);
+    if (ok && trash)
+        ok = collectShards("trash", output.TrashFile, options);
+
+    for (int k = 0; k < options.NumShards; k++)
+        for (const char *kind : {"in1", "in2", "out", "trash"})
+            remove(shardFileName(options, k, kind).c_str());
+    return ok;
+}
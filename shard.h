@@ -0,0 +1,33 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <string>
+
+#include "bamio.h"
+#include "hashjoin.h"
+#include "merge.h"
+
+struct ShardOptions
+{
+    int NumShards;
+    bool Sorted;              // inputs sorted by names (mergeSortedFiles), else hashJoinMerge
+    NameOrder Order;          // of the names of sorted inputs
+    HashJoinOptions HashJoin; // options of hashJoinMerge, the memory limit is shared by the shards
+    std::string TempPrefix;   // prefix of the temporary shard files
+    std::string HeaderText;   // header of the output files
+    BamTools::RefVector References;
+    BgzfPool *Pool; // compression workers for all the files, may be nullptr
+};
+
+// Merge two BAM files on several threads. Both files are partitioned by read-name hash into
+// temporary shards, which keeps the reads of one name together and, within a shard, the order of
+// the input. The shard pairs are merged independently on one thread each, then their outputs are
+// merged back by name for sorted inputs (same output as mergeSortedFiles()) or concatenated for
+// unsorted inputs. The lines of the discard manifest are written in the order the shards reach
+// them. Returns false (after printing an error message) on error.
+bool shardedMerge(BamInput &file1,
+                  BamInput &file2,
+                  MergeOutput &output,
+                  const ShardOptions &options);
+
+#endif
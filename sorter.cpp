@@ -0,0 +1,176 @@
+#include "sorter.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <queue>
+
+#include "bamio.h"
+
+using namespace std;
+
+// Fixed-length fields of an encoded record, after its block_size
+static const size_t CORE_SIZE = 32;
+
+static int32_t unpackInt32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return (int32_t)(u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24);
+}
+
+static uint16_t unpackUint16(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return u[0] | u[1] << 8;
+}
+
+// Sort key of an encoded record, given its block_size
+static uint64_t recordLocus(const char *record)
+{
+    const uint32_t refID = unpackInt32(record + 4);
+    const uint32_t position = unpackInt32(record + 8) + 1;
+    return (uint64_t)refID << 32 | position;
+}
+
+// Add an encoded record, written at offset of the uncompressed stream, to the index. Unmapped
+// reads placed at the position of their mate cover one base.
+static void indexRecord(const char *record, uint64_t offset, BaiWriter &index)
+{
+    const char *data = record + 4;
+    const size_t size = 4 + unpackInt32(record);
+    const int32_t refID = unpackInt32(data);
+    const int64_t position = unpackInt32(data + 4);
+    const uint8_t nameLength = data[8];
+    const uint16_t numCigarOps = unpackUint16(data + 12);
+    const bool mapped = (unpackUint16(data + 14) & 0x4) == 0;
+    const int64_t length =
+        mapped ? cigarReferenceLength(data + CORE_SIZE + nameLength, numCigarOps) : 0;
+    index.Add(refID, position, position + max(length, (int64_t)1), mapped, offset, offset + size);
+}
+
+BamSorter::BamSorter(size_t memoryLimit, const string &tempPrefix, BgzfPool *pool) :
+    mMemoryLimit(memoryLimit),
+    mTempPrefix(tempPrefix),
+    mPool(pool)
+{
+}
+
+BamSorter::~BamSorter()
+{
+    for (const string &name : mRuns)
+        remove(name.c_str());
+}
+
+bool BamSorter::Add(const string &batch)
+{
+    const size_t start = mBuffer.size();
+    mBuffer += batch;
+    for (size_t p = start; p < mBuffer.size(); p += 4 + unpackInt32(&mBuffer[p]))
+        mKeys.push_back({recordLocus(&mBuffer[p]), p});
+
+    if (mBuffer.size() + mKeys.size() * sizeof(Key) < mMemoryLimit)
+        return true;
+    return Spill();
+}
+
+// Write the records held in memory, sorted, to a temporary file
+bool BamSorter::Spill()
+{
+    const string name = mTempPrefix + ".sort" + to_string(mRuns.size()) + ".tmp";
+    mRuns.push_back(name);
+    sort(mKeys.begin(), mKeys.end());
+
+    BgzfWriter run;
+    bool ok = run.Open(name, 1, mPool);
+    for (size_t k = 0; k < mKeys.size() && ok; k++)
+    {
+        const char *record = &mBuffer[mKeys[k].Offset];
+        ok = run.Write(record, 4 + unpackInt32(record));
+    }
+    ok = run.Close() && ok;
+    if (!ok)
+        cerr << "Error: Could not write temporary file " << name << "." << endl;
+
+    mBuffer.clear();
+    mKeys.clear();
+    return ok;
+}
+
+bool BamSorter::Write(BgzfWriter &stream, uint64_t offset, BaiWriter &index)
+{
+    if (!mRuns.empty())
+        return (mKeys.empty() || Spill()) && MergeRuns(stream, offset, index);
+
+    sort(mKeys.begin(), mKeys.end());
+    for (const Key &key : mKeys)
+    {
+        const char *record = &mBuffer[key.Offset];
+        const size_t size = 4 + unpackInt32(record);
+        indexRecord(record, offset, index);
+        if (!stream.Write(record, size))
+            return false;
+        offset += size;
+    }
+    mBuffer.clear();
+    mKeys.clear();
+    return true;
+}
+
+// Merge the sorted runs into the stream. Records at the same place are taken from the runs in the
+// order they were written, which keeps them in the order they were added.
+bool BamSorter::MergeRuns(BgzfWriter &stream, uint64_t offset, BaiWriter &index)
+{
+    const size_t numRuns = mRuns.size();
+    vector<BgzfReader> runs(numRuns);
+    vector<string> records(numRuns);
+    typedef pair<uint64_t, size_t> Head; // locus of the next record of a run, run
+    priority_queue<Head, vector<Head>, greater<Head>> heads;
+    bool ok = true;
+
+    // Read the next record of run k into records[k]
+    auto next = [&](size_t k) {
+        char size[4];
+        const size_t n = runs[k].Read(size, 4);
+        if (n == 0 && !runs[k].HasError())
+            return;
+        records[k].assign(size, 4);
+        records[k].resize(4 + unpackInt32(size));
+        if (n != 4 || runs[k].Read(&records[k][4], records[k].size() - 4) != records[k].size() - 4)
+        {
+            cerr << "Error: Could not read temporary file " << mRuns[k] << "." << endl;
+            ok = false;
+            return;
+        }
+        heads.emplace(recordLocus(records[k].data()), k);
+    };
+
+    for (size_t k = 0; k < numRuns && ok; k++)
+    {
+        if (!runs[k].Open(mRuns[k], 4))
+        {
+            cerr << "Error: Could not read temporary file " << mRuns[k] << "." << endl;
+            return false;
+        }
+        next(k);
+    }
+
+    while (!heads.empty() && ok)
+    {
+        const size_t k = heads.top().second;
+        heads.pop();
+        indexRecord(records[k].data(), offset, index);
+        if (!stream.Write(records[k].data(), records[k].size()))
+            return false;
+        offset += records[k].size();
+        next(k);
+    }
+
+    for (size_t k = 0; k < numRuns; k++)
+    {
+        runs[k].Close();
+        remove(mRuns[k].c_str());
+    }
+    mRuns.clear();
+    return ok;
+}
@@ -0,0 +1,52 @@
+#ifndef SORTER_H
+#define SORTER_H
+
+#include <string>
+#include <vector>
+
+#include "bamindex.h"
+#include "bgzf.h"
+
+// Sort the encoded records written to a BamOutput by coordinates: by RefID, then position, the
+// unplaced records last, and the records at the same place in the order they were added. Records
+// are held in memory up to a limit; beyond it, sorted runs are spilled to temporary files that
+// are merged when the output is written.
+class BamSorter
+{
+public:
+    // The runs are written next to tempPrefix, with the compression workers of pool (may be
+    // nullptr)
+    BamSorter(size_t memoryLimit, const std::string &tempPrefix, BgzfPool *pool);
+    ~BamSorter();
+
+    // Add a batch of encoded records, each preceded by its block_size
+    bool Add(const std::string &batch);
+    // Write the sorted records to a stream positioned at byte offset of the uncompressed data, and
+    // add them to index. Returns false (after printing an error message) on error.
+    bool Write(BgzfWriter &stream, uint64_t offset, BaiWriter &index);
+
+private:
+    // Sort key of a record and where it starts in mBuffer
+    struct Key
+    {
+        uint64_t Locus; // RefID << 32 | position + 1, unsigned so that RefID -1 comes last
+        size_t Offset;
+
+        bool operator<(const Key &other) const
+        {
+            return Locus < other.Locus || (Locus == other.Locus && Offset < other.Offset);
+        }
+    };
+
+    bool Spill();
+    bool MergeRuns(BgzfWriter &stream, uint64_t offset, BaiWriter &index);
+
+    size_t mMemoryLimit;
+    std::string mTempPrefix;
+    BgzfPool *mPool;
+    std::string mBuffer;
+    std::vector<Key> mKeys;
+    std::vector<std::string> mRuns; // names of the temporary files
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include "stats.h"
+
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+static const char *TRASH_REASON_NAMES[NUM_TRASH_REASONS] = {
+    "unmapped", "position", "cigar", "widow"};
+
+const char *trashReasonName(TrashReason reason)
+{
+    return TRASH_REASON_NAMES[reason];
+}
+
+ProgressMeter::ProgressMeter(int interval) :
+    mInterval(chrono::duration_cast<Clock::duration>(chrono::seconds(interval))),
+    mRecords(0),
+    mStart(Clock::now()),
+    mLast(mStart),
+    mLastRecords(0)
+{
+}
+
+void ProgressMeter::Add(uint64_t records)
+{
+    uint64_t total = mRecords.fetch_add(records, memory_order_relaxed) + records;
+    Clock::time_point now = Clock::now();
+    // Only one thread prints a given line, the others go on
+    unique_lock<mutex> lock(mMutex, try_to_lock);
+    if (!lock.owns_lock() || now - mLast < mInterval)
+        return;
+
+    chrono::duration<double> elapsed = now - mStart;
+    chrono::duration<double> sinceLast = now - mLast;
+    cerr << "Progress: " << total << " records merged in " << (long)elapsed.count() << " s, "
+         << (long)((total - mLastRecords) / sinceLast.count()) << " records/s" << endl;
+    mLast = now;
+    mLastRecords = total;
+}
+
+
+int refNumber(unsigned mask)
+{
+    int number = 0;
+    for (int k = 0; mask >> k != 0; k++)
+        if (mask & (1u << k))
+            number = number * 10 + k + 1;
+    return number;
+}
+
+
+MergeStats::MergeStats(int numFiles) :
+    RecordsRead(numFiles, 0),
+    Kept((size_t)1 << numFiles, 0),
+    Trashed{0},
+    DroppedUnmapped(0),
+    ReadSeconds(0),
+    DecideSeconds(0),
+    WriteSeconds(0),
+    Progress(nullptr)
+{
+}
+
+void MergeStats::Add(const MergeStats &other)
+{
+    for (size_t i = 0; i < RecordsRead.size() && i < other.RecordsRead.size(); i++)
+        RecordsRead[i] += other.RecordsRead[i];
+    for (size_t i = 0; i < Kept.size() && i < other.Kept.size(); i++)
+        Kept[i] += other.Kept[i];
+    for (int i = 0; i < NUM_TRASH_REASONS; i++)
+        Trashed[i] += other.Trashed[i];
+    DroppedUnmapped += other.DroppedUnmapped;
+    ReadSeconds += other.ReadSeconds;
+    DecideSeconds += other.DecideSeconds;
+    WriteSeconds += other.WriteSeconds;
+}
+
+bool MergeStats::Write(const string &filename) const
+{
+    ofstream out(filename);
+    if (!out)
+        return false;
+
+    if (filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0)
+    {
+        out << "{\n";
+        for (size_t i = 0; i < RecordsRead.size(); i++)
+            out << "  \"records_read" << i + 1 << "\": " << RecordsRead[i] << ",\n";
+        for (size_t i = 1; i < Kept.size(); i++)
+            out << "  \"kept_rn" << refNumber(i) << "\": " << Kept[i] << ",\n";
+        for (int i = 0; i < NUM_TRASH_REASONS; i++)
+            out << "  \"trashed_" << TRASH_REASON_NAMES[i] << "\": " << Trashed[i] << ",\n";
+        out << "  \"dropped_unmapped\": " << DroppedUnmapped << ",\n";
+        out << "  \"read_seconds\": " << ReadSeconds << ",\n";
+        out << "  \"decide_seconds\": " << DecideSeconds << ",\n";
+        out << "  \"write_seconds\": " << WriteSeconds << "\n";
+        out << "}\n";
+    }
+    else
+    {
+        for (size_t i = 0; i < RecordsRead.size(); i++)
+            out << "records_read" << i + 1 << "\t" << RecordsRead[i] << "\n";
+        for (size_t i = 1; i < Kept.size(); i++)
+            out << "kept_rn" << refNumber(i) << "\t" << Kept[i] << "\n";
+        for (int i = 0; i < NUM_TRASH_REASONS; i++)
+            out << "trashed_" << TRASH_REASON_NAMES[i] << "\t" << Trashed[i] << "\n";
+        out << "dropped_unmapped\t" << DroppedUnmapped << "\n";
+        out << "read_seconds\t" << ReadSeconds << "\n";
+        out << "decide_seconds\t" << DecideSeconds << "\n";
+        out << "write_seconds\t" << WriteSeconds << "\n";
+    }
+    out.close();
+    return !out.fail();
+}
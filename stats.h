@@ -0,0 +1,68 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Why records were discarded
+enum TrashReason
+{
+    TRASH_UNMAPPED, // unmapped in all the files (the records of one of them)
+    TRASH_POSITION, // mapped at different positions in the files
+    TRASH_CIGAR,    // mapped at the same position with different CIGARs
+    TRASH_WIDOW,    // both mates in one file but only one in another
+    NUM_TRASH_REASONS
+};
+
+// Name of a reason in the logfile and the discard manifest
+const char *trashReasonName(TrashReason reason);
+
+// Prints a line on stderr with the number of records merged and the current rate every
+// 'interval' seconds. Can be shared by several threads.
+class ProgressMeter
+{
+public:
+    explicit ProgressMeter(int interval);
+
+    // Called after each batch of records
+    void Add(uint64_t records);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    const Clock::duration mInterval;
+    std::atomic<uint64_t> mRecords;
+    std::mutex mMutex;
+    Clock::time_point mStart;
+    Clock::time_point mLast; // time of the last line
+    uint64_t mLastRecords;
+};
+
+// RN tag of the records kept from the input files of mask (bit k for file k + 1): the numbers of
+// these files in increasing order, e.g. 12 for files 1 and 2
+int refNumber(unsigned mask);
+
+// Counters of a merge. Each thread updates its own MergeStats, which are added up at the end.
+struct MergeStats
+{
+    explicit MergeStats(int numFiles = 2);
+
+    void Add(const MergeStats &other);
+    // Write the counters to filename, as JSON if it ends with .json and as TSV otherwise
+    bool Write(const std::string &filename) const;
+
+    std::vector<uint64_t> RecordsRead;   // per input file
+    std::vector<uint64_t> Kept;          // written to the output file, by mask of the RN tag
+    uint64_t Trashed[NUM_TRASH_REASONS]; // records written to the trash file
+    uint64_t DroppedUnmapped;            // unmapped copies of reads kept or trashed elsewhere
+    double ReadSeconds;                  // reading the inputs (sorted inputs only)
+    double DecideSeconds;                // merge decisions (sorted inputs only)
+    double WriteSeconds;                 // compressing and writing the outputs
+    ProgressMeter *Progress;             // nullptr: no progress lines
+};
+
+#endif